@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs_internal.h"
+#include "fs_util.h"
+#include "dir.h"
+#include "journal.h"
+
+typedef union {
+		Dentry leaf;
+		DirIndexRoot root;
+		DirIndexNode node;
+		char raw[BLOCK_SIZE];
+} DirBlock;
+
+// where a name hash leads: the index entries taken and the leaf reached
+typedef struct {
+		int rootPos;
+		int node; // DirIndexNode block, -1 when the root points at leaves
+		int nodePos;
+		int leaf;
+} DirPath;
+
+typedef struct {
+		unsigned int hash;
+		DirectoryEntry e;
+} HashedEntry;
+
+static unsigned int dcache_set(int dir, char *name) {
+	return (name_hash(name) ^ (unsigned int)dir * 2654435761u) % DCACHE_SETS;
+} // dcache_set()
+
+// the entry for (dir, name) in set s, whose lock the caller holds
+static DcacheEntry *dcache_find(unsigned int s, int dir, char *name) {
+	DcacheEntry *set = fs->dcache.set[s];
+	int i;
+
+	for (i = 0; i < DCACHE_WAYS; i++) {
+		if (set[i].dir == dir && strcmp(set[i].name, name) == 0)
+			return &set[i];
+	} // for
+	return NULL;
+} // dcache_find()
+
+// the cached inode of name, -1 for a cached miss, -2 when nothing is cached
+static int dcache_get(int dir, char *name) {
+	unsigned int s = dcache_set(dir, name);
+	DcacheEntry *e;
+	int inodeNum = -2;
+
+	pthread_mutex_lock(&fs->dcache.lock[s]);
+	if ((e = dcache_find(s, dir, name)) != NULL)
+		inodeNum = e->inode;
+	pthread_mutex_unlock(&fs->dcache.lock[s]);
+	return inodeNum;
+} // dcache_get()
+
+static void dcache_insert(int dir, char *name, int inodeNum) {
+	unsigned int s = dcache_set(dir, name);
+	DcacheEntry *e;
+
+	pthread_mutex_lock(&fs->dcache.lock[s]);
+	e = dcache_find(s, dir, name);
+	if (e == NULL) {
+		e = &fs->dcache.set[s][fs->dcache.next[s]];
+		fs->dcache.next[s] = (fs->dcache.next[s] + 1) % DCACHE_WAYS;
+		e->dir = dir;
+		strcpy(e->name, name);
+	} // if
+	e->inode = inodeNum;
+	pthread_mutex_unlock(&fs->dcache.lock[s]);
+} // dcache_insert()
+
+// drop everything cached under a directory that is going away
+static void dcache_purge(int dir) {
+	int i, j;
+
+	for (i = 0; i < DCACHE_SETS; i++) {
+		pthread_mutex_lock(&fs->dcache.lock[i]);
+		for (j = 0; j < DCACHE_WAYS; j++) {
+			if (fs->dcache.set[i][j].dir == dir)
+				fs->dcache.set[i][j].dir = -1;
+		} // for
+		pthread_mutex_unlock(&fs->dcache.lock[i]);
+	} // for
+} // dcache_purge()
+
+void dir_cache_init() {
+	int i;
+
+	for (i = 0; i < DCACHE_SETS; i++)
+		pthread_mutex_init(&fs->dcache.lock[i], NULL);
+	dir_cache_reset();
+} // dir_cache_init()
+
+void dir_cache_destroy() {
+	int i;
+
+	for (i = 0; i < DCACHE_SETS; i++)
+		pthread_mutex_destroy(&fs->dcache.lock[i]);
+} // dir_cache_destroy()
+
+void dir_cache_reset() {
+	int i, j;
+
+	for (i = 0; i < DCACHE_SETS; i++) {
+		for (j = 0; j < DCACHE_WAYS; j++)
+			fs->dcache.set[i][j].dir = -1;
+	} // for
+	fs->dcache.hits = fs->dcache.misses = 0;
+} // dir_cache_reset()
+
+void dir_cache_stats(long *hits, long *misses) {
+	*hits = __atomic_load_n(&fs->dcache.hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&fs->dcache.misses, __ATOMIC_RELAXED);
+} // dir_cache_stats()
+
+static int is_indexed(DirBlock *b) {
+	return b->root.magic == DIR_INDEX_MAGIC;
+} // is_indexed()
+
+static void set_entry(DirectoryEntry *e, char *name, int inodeNum) {
+	memset(e->name, 0, MAX_FILE_NAME);
+	strcpy(e->name, name);
+	e->inode = inodeNum;
+} // set_entry()
+
+// slot holding name in a leaf, or -1
+static int leaf_find(Dentry *leaf, char *name) {
+	int i;
+	for (i = 0; i < leaf->numEntry; i++) {
+		if (strcmp(name, leaf->dentry[i].name) == 0)
+			return i;
+	}
+	return -1;
+} // leaf_find()
+
+// drop a slot by moving the last entry into it
+static void leaf_remove(Dentry *leaf, int slot) {
+	leaf->dentry[slot] = leaf->dentry[leaf->numEntry - 1];
+	leaf->numEntry--;
+} // leaf_remove()
+
+// position of the last index entry whose hash is <= h
+static int index_search(DirIndexEntry *entry, int count, unsigned int h) {
+	int lo = 0, hi = count - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (entry[mid].hash <= h)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+} // index_search()
+
+static void index_insert_at(DirIndexEntry *entry, int *count, int pos, unsigned int hash, int block) {
+	memmove(entry + pos + 1, entry + pos, (*count - pos) * sizeof(DirIndexEntry));
+	entry[pos].hash = hash;
+	entry[pos].block = block;
+	(*count)++;
+} // index_insert_at()
+
+static void find_leaf(DirIndexRoot *root, unsigned int h, DirPath *path) {
+	DirBlock node;
+
+	path->rootPos = index_search(root->entry, root->count, h);
+	path->node = -1;
+	path->nodePos = -1;
+	path->leaf = root->entry[path->rootPos].block;
+	if (root->levels == 1) {
+		path->node = path->leaf;
+		disk_read(path->node, node.raw);
+		path->nodePos = index_search(node.node.entry, node.node.count, h);
+		path->leaf = node.node.entry[path->nodePos].block;
+	} // if
+} // find_leaf()
+
+static int alloc_dir_block(int dirInode) {
+	int block = get_free_block();
+	if (block >= 0)
+		iget_dirty(dirInode)->blockCount++;
+	return block;
+} // alloc_dir_block()
+
+static int cmp_hashed(const void *a, const void *b) {
+	unsigned int x = ((HashedEntry *)a)->hash, y = ((HashedEntry *)b)->hash;
+	return x < y ? -1 : x > y;
+} // cmp_hashed()
+
+/*
+ * Turn a full single-block directory into an index root with one leaf.
+ * "." and ".." move into the root, everything else into the leaf.
+ */
+static int convert_to_index(int dirInode, DirBlock *b) {
+	DirBlock leaf;
+	DirIndexRoot root;
+	int i, leafBlock;
+
+	if (free_block_count() < 1)
+		return -1;
+	leafBlock = alloc_dir_block(dirInode);
+
+	memset(&root, 0, sizeof(root));
+	memset(&leaf, 0, sizeof(leaf));
+	root.magic = DIR_INDEX_MAGIC;
+	root.numEntry = b->leaf.numEntry;
+	root.parent = -1;
+	for (i = 0; i < b->leaf.numEntry; i++) {
+		DirectoryEntry *e = &b->leaf.dentry[i];
+		if (strcmp(e->name, ".") == 0)
+			root.self = e->inode;
+		else if (strcmp(e->name, "..") == 0)
+			root.parent = e->inode;
+		else
+			leaf.leaf.dentry[leaf.leaf.numEntry++] = *e;
+	} // for
+	root.count = 1;
+	root.entry[0].hash = 0;
+	root.entry[0].block = leafBlock;
+
+	journal_write(leafBlock, leaf.raw);
+	b->root = root;
+	journal_write(iget(dirInode)->directBlock[0], b->raw);
+	return 0;
+} // convert_to_index()
+
+/*
+ * Hook a new leaf into the index after the path's entry. The caller has
+ * already checked that the blocks this needs are free.
+ */
+static void index_insert(int dirInode, DirIndexRoot *root, DirPath *path, DirBlock *node, unsigned int hash, int block) {
+	DirBlock upper;
+	int nodeBlock, half;
+
+	if (root->levels == 0 && root->count < DIR_ROOT_ENTRIES) {
+		index_insert_at(root->entry, &root->count, path->rootPos + 1, hash, block);
+		return;
+	} // if
+
+	if (root->levels == 0) {
+		// the root is full: push its entries down into a node
+		nodeBlock = alloc_dir_block(dirInode);
+		memset(node, 0, sizeof(*node));
+		node->node.count = root->count;
+		memcpy(node->node.entry, root->entry, root->count * sizeof(DirIndexEntry));
+		root->levels = 1;
+		root->count = 1;
+		root->entry[0].hash = 0;
+		root->entry[0].block = nodeBlock;
+		path->node = nodeBlock;
+		path->nodePos = path->rootPos;
+		path->rootPos = 0;
+	} // if
+
+	if (node->node.count < DIR_NODE_ENTRIES) {
+		index_insert_at(node->node.entry, &node->node.count, path->nodePos + 1, hash, block);
+		journal_write(path->node, node->raw);
+		return;
+	} // if
+
+	// the node is full: move its upper half into a new node
+	nodeBlock = alloc_dir_block(dirInode);
+	half = node->node.count / 2;
+	memset(&upper, 0, sizeof(upper));
+	upper.node.count = node->node.count - half;
+	memcpy(upper.node.entry, node->node.entry + half, upper.node.count * sizeof(DirIndexEntry));
+	node->node.count = half;
+	index_insert_at(root->entry, &root->count, path->rootPos + 1, upper.node.entry[0].hash, nodeBlock);
+
+	if (path->nodePos + 1 <= half)
+		index_insert_at(node->node.entry, &node->node.count, path->nodePos + 1, hash, block);
+	else
+		index_insert_at(upper.node.entry, &upper.node.count, path->nodePos + 1 - half, hash, block);
+	journal_write(path->node, node->raw);
+	journal_write(nodeBlock, upper.raw);
+} // index_insert()
+
+/*
+ * Add an entry to a full leaf by splitting it in two by name hash. Names
+ * with equal hashes always stay in the same leaf, so a lookup only ever
+ * has one leaf to search.
+ */
+static int split_leaf(int dirInode, DirIndexRoot *root, DirPath *path, Dentry *leaf, char *name, int inodeNum, unsigned int h) {
+	HashedEntry all[MAX_DIR_ENTRY + 1];
+	DirBlock node, right;
+	int n = leaf->numEntry, need = 1, i, k = -1, d;
+
+	// only a full leaf is split; any other count means the block is corrupt
+	if (n != MAX_DIR_ENTRY)
+		return DIR_CORRUPT;
+	for (i = 0; i < n; i++) {
+		all[i].e = leaf->dentry[i];
+		all[i].hash = name_hash(leaf->dentry[i].name);
+	} // for
+	set_entry(&all[n].e, name, inodeNum);
+	all[n].hash = h;
+	n++;
+	qsort(all, n, sizeof(HashedEntry), cmp_hashed);
+
+	// split as close to the middle as the hashes allow
+	for (d = 0; d <= n / 2 && k < 0; d++) {
+		if (n / 2 + d < n && all[n / 2 + d - 1].hash != all[n / 2 + d].hash)
+			k = n / 2 + d;
+		else if (n / 2 - d > 0 && all[n / 2 - d - 1].hash != all[n / 2 - d].hash)
+			k = n / 2 - d;
+	} // for
+	if (k < 0)
+		return -1;
+
+	// make sure the index has room for one more leaf before changing anything
+	if (root->levels == 0) {
+		if (root->count == DIR_ROOT_ENTRIES)
+			need++;
+	} else {
+		disk_read(path->node, node.raw);
+		if (node.node.count == DIR_NODE_ENTRIES) {
+			if (root->count == DIR_ROOT_ENTRIES)
+				return -1;
+			need++;
+		} // if
+	} // if-else
+	if (free_block_count() < need)
+		return -1;
+
+	int rightBlock = alloc_dir_block(dirInode);
+	memset(&right, 0, sizeof(right));
+	leaf->numEntry = 0;
+	for (i = 0; i < n; i++) {
+		if (i < k)
+			leaf->dentry[leaf->numEntry++] = all[i].e;
+		else
+			right.leaf.dentry[right.leaf.numEntry++] = all[i].e;
+	} // for
+	journal_write(path->leaf, (char *)leaf);
+	journal_write(rightBlock, right.raw);
+
+	index_insert(dirInode, root, path, &node, all[k].hash, rightBlock);
+	return 0;
+} // split_leaf()
+
+// set up an empty directory in a new block, parentInode < 0 leaves out ".."
+int dir_init(int dirInode, int parentInode) {
+	DirBlock b;
+	int block = get_free_block();
+
+	if (block < 0)
+		return -1;
+
+	memset(&b, 0, sizeof(b));
+	set_entry(&b.leaf.dentry[b.leaf.numEntry++], ".", dirInode);
+	if (parentInode >= 0)
+		set_entry(&b.leaf.dentry[b.leaf.numEntry++], "..", parentInode);
+	journal_write(block, b.raw);
+
+	iget_dirty(dirInode)->directBlock[0] = block;
+	iget_dirty(dirInode)->blockCount = 1;
+	dcache_purge(dirInode);
+	return block;
+} // dir_init()
+
+static int dir_lookup_blocks(int dirInode, char *name) {
+	DirBlock b;
+	DirPath path;
+	int slot;
+
+	disk_read(iget(dirInode)->directBlock[0], b.raw);
+	if (is_indexed(&b)) {
+		if (strcmp(name, ".") == 0)
+			return b.root.self;
+		if (strcmp(name, "..") == 0)
+			return b.root.parent;
+		find_leaf(&b.root, name_hash(name), &path);
+		disk_read(path.leaf, b.raw);
+	} // if
+
+	slot = leaf_find(&b.leaf, name);
+	if (slot < 0)
+		return -1;
+	return b.leaf.dentry[slot].inode;
+} // dir_lookup_blocks()
+
+// return the inode of name in the directory, or -1
+int dir_lookup(int dirInode, char *name) {
+	int inodeNum;
+
+	if (strlen(name) >= MAX_FILE_NAME)
+		return -1;
+	inodeNum = dcache_get(dirInode, name);
+	if (inodeNum != -2) {
+		__atomic_fetch_add(&fs->dcache.hits, 1, __ATOMIC_RELAXED);
+		return inodeNum;
+	} // if
+
+	__atomic_fetch_add(&fs->dcache.misses, 1, __ATOMIC_RELAXED);
+	inodeNum = dir_lookup_blocks(dirInode, name);
+	dcache_insert(dirInode, name, inodeNum);
+	return inodeNum;
+} // dir_lookup()
+
+/*
+ * Add name -> inodeNum to the directory. Returns 0, DIR_BAD_NAME when the
+ * name does not fit in a DirectoryEntry, DIR_FULL when the index or the
+ * disk has no room left, or DIR_CORRUPT for a leaf with a bad entry count.
+ */
+int dir_add_entry(int dirInode, char *name, int inodeNum) {
+	int rootBlock = iget(dirInode)->directBlock[0];
+	DirBlock b, leaf;
+	DirPath path;
+	unsigned int h;
+	int ret;
+
+	if (strlen(name) == 0 || strlen(name) >= MAX_FILE_NAME)
+		return DIR_BAD_NAME;
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return DIR_BAD_NAME;
+
+	disk_read(rootBlock, b.raw);
+	if (!is_indexed(&b)) {
+		if (b.leaf.numEntry < MAX_DIR_ENTRY) {
+			set_entry(&b.leaf.dentry[b.leaf.numEntry++], name, inodeNum);
+			journal_write(rootBlock, b.raw);
+			dcache_insert(dirInode, name, inodeNum);
+			return 0;
+		} // if
+		if (convert_to_index(dirInode, &b) < 0)
+			return DIR_FULL;
+	} // if
+
+	h = name_hash(name);
+	find_leaf(&b.root, h, &path);
+	disk_read(path.leaf, leaf.raw);
+	if (leaf.leaf.numEntry < MAX_DIR_ENTRY) {
+		set_entry(&leaf.leaf.dentry[leaf.leaf.numEntry++], name, inodeNum);
+		journal_write(path.leaf, leaf.raw);
+	} else if ((ret = split_leaf(dirInode, &b.root, &path, &leaf.leaf, name, inodeNum, h)) < 0) {
+		return ret;
+	} // if-else
+
+	b.root.numEntry++;
+	journal_write(rootBlock, b.raw);
+	dcache_insert(dirInode, name, inodeNum);
+	return 0;
+} // dir_add_entry()
+
+int dir_remove_entry(int dirInode, char *name) {
+	int rootBlock = iget(dirInode)->directBlock[0];
+	DirBlock b, leaf;
+	DirPath path;
+	int slot;
+
+	disk_read(rootBlock, b.raw);
+	if (!is_indexed(&b)) {
+		slot = leaf_find(&b.leaf, name);
+		if (slot < 0)
+			return -1;
+		leaf_remove(&b.leaf, slot);
+		journal_write(rootBlock, b.raw);
+		dcache_insert(dirInode, name, -1);
+		return 0;
+	} // if
+
+	find_leaf(&b.root, name_hash(name), &path);
+	disk_read(path.leaf, leaf.raw);
+	slot = leaf_find(&leaf.leaf, name);
+	if (slot < 0)
+		return -1;
+	leaf_remove(&leaf.leaf, slot);
+	journal_write(path.leaf, leaf.raw);
+
+	b.root.numEntry--;
+	journal_write(rootBlock, b.raw);
+	dcache_insert(dirInode, name, -1);
+	return 0;
+} // dir_remove_entry()
+
+// number of entries, "." and ".." included
+int dir_num_entries(int dirInode) {
+	DirBlock b;
+
+	disk_read(iget(dirInode)->directBlock[0], b.raw);
+	return is_indexed(&b) ? b.root.numEntry : b.leaf.numEntry;
+} // dir_num_entries()
+
+static void visit_leaf(int block, DirVisitor visit, void *arg) {
+	DirBlock leaf;
+	int i;
+
+	disk_read(block, leaf.raw);
+	for (i = 0; i < leaf.leaf.numEntry; i++)
+		visit(leaf.leaf.dentry[i].name, leaf.leaf.dentry[i].inode, arg);
+} // visit_leaf()
+
+void dir_foreach(int dirInode, DirVisitor visit, void *arg) {
+	DirBlock b, node;
+	int i, j;
+
+	disk_read(iget(dirInode)->directBlock[0], b.raw);
+	if (!is_indexed(&b)) {
+		for (i = 0; i < b.leaf.numEntry; i++)
+			visit(b.leaf.dentry[i].name, b.leaf.dentry[i].inode, arg);
+		return;
+	} // if
+
+	visit(".", b.root.self, arg);
+	if (b.root.parent >= 0)
+		visit("..", b.root.parent, arg);
+	for (i = 0; i < b.root.count; i++) {
+		if (b.root.levels == 0) {
+			visit_leaf(b.root.entry[i].block, visit, arg);
+			continue;
+		} // if
+		disk_read(b.root.entry[i].block, node.raw);
+		for (j = 0; j < node.node.count; j++)
+			visit_leaf(node.node.entry[j].block, visit, arg);
+	} // for
+} // dir_foreach()
+
+// free every block of the directory, index and leaves included
+void dir_release(int dirInode) {
+	DirBlock b, node;
+	int i, j;
+
+	disk_read(iget(dirInode)->directBlock[0], b.raw);
+	if (is_indexed(&b)) {
+		for (i = 0; i < b.root.count; i++) {
+			if (b.root.levels == 1) {
+				disk_read(b.root.entry[i].block, node.raw);
+				for (j = 0; j < node.node.count; j++)
+					set_free_block(node.node.entry[j].block);
+			} // if
+			set_free_block(b.root.entry[i].block);
+		} // for
+	} // if
+	set_free_block(iget(dirInode)->directBlock[0]);
+	iget_dirty(dirInode)->blockCount = 0;
+	dcache_purge(dirInode);
+} // dir_release()
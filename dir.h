@@ -0,0 +1,86 @@
+#ifndef DIR_H
+#define DIR_H
+
+#include <pthread.h>
+
+/*
+ * Directories. A small directory is a single Dentry block, as it always
+ * was. Once that block fills up, it turns into the root of an index keyed
+ * by name hash: the root (and, past one level, the DirIndexNode blocks it
+ * points to) maps hash ranges to leaf blocks, and each leaf is an ordinary
+ * Dentry holding the names whose hash falls in its range. Lookup, insert
+ * and delete read one root, at most one node and one leaf.
+ *
+ * Callers hold the directory's inode lock: shared for dir_lookup(),
+ * dir_num_entries() and dir_foreach(), exclusive for the rest.
+ */
+#define DIR_INDEX_MAGIC 0x48545245 // "HTRE", where Dentry keeps numEntry
+#define DIR_ROOT_ENTRIES ((BLOCK_SIZE - 6 * sizeof(int)) / sizeof(DirIndexEntry))
+#define DIR_NODE_ENTRIES ((BLOCK_SIZE - 2 * sizeof(int)) / sizeof(DirIndexEntry))
+#define DIR_TX_BLOCKS 6 // blocks one add or remove writes at most, a new directory's own block included
+
+typedef struct {
+		unsigned int hash; // lowest name hash stored below block
+		int block;
+} DirIndexEntry;
+
+typedef struct {
+		int magic;
+		int numEntry; // entries in the whole directory, "." and ".." included
+		int self; // inode of "."
+		int parent; // inode of "..", -1 for the root directory
+		int levels; // 0: entries point at leaves, 1: at DirIndexNode blocks
+		int count;
+		DirIndexEntry entry[DIR_ROOT_ENTRIES];
+} DirIndexRoot;
+
+typedef struct {
+		int count;
+		int padding;
+		DirIndexEntry entry[DIR_NODE_ENTRIES];
+} DirIndexNode;
+
+/*
+ * Dentry cache: recent (directory, name) -> inode lookups, names that were
+ * not found included (inode -1). It is set associative with round-robin
+ * replacement inside a set, and dir_add_entry(), dir_remove_entry() and
+ * dir_release() keep it exact, so a hit never needs a directory read.
+ * Each set has its own lock, and the counters are atomic.
+ */
+#define DCACHE_SETS 256
+#define DCACHE_WAYS 4
+
+typedef struct {
+		int dir; // -1 for an unused entry
+		int inode;
+		char name[MAX_FILE_NAME];
+} DcacheEntry;
+
+typedef struct {
+		DcacheEntry set[DCACHE_SETS][DCACHE_WAYS];
+		unsigned char next[DCACHE_SETS];
+		pthread_mutex_t lock[DCACHE_SETS];
+		long hits;
+		long misses;
+} DirCache;
+
+// dir_add_entry() failures
+#define DIR_FULL -1
+#define DIR_BAD_NAME -2
+#define DIR_CORRUPT -3
+
+typedef void (*DirVisitor)(char *name, int inodeNum, void *arg);
+
+int dir_init(int dirInode, int parentInode);
+int dir_lookup(int dirInode, char *name);
+int dir_add_entry(int dirInode, char *name, int inodeNum);
+int dir_remove_entry(int dirInode, char *name);
+int dir_num_entries(int dirInode);
+void dir_foreach(int dirInode, DirVisitor visit, void *arg);
+void dir_release(int dirInode);
+void dir_cache_init();
+void dir_cache_destroy();
+void dir_cache_reset();
+void dir_cache_stats(long *hits, long *misses);
+
+#endif
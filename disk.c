@@ -1,51 +1,643 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "disk.h"
 
-char disk[MAX_BLOCK][BLOCK_SIZE];
+#define DISK_BYTES ((size_t)MAX_BLOCK * BLOCK_SIZE)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * Buffer cache used in DISK_CACHE mode. Buffers sit on one LRU list, most
+ * recently used at the head; a miss recycles the tail, writing it back
+ * first when it is dirty. A hash table on block number finds buffers.
+ */
+typedef struct {
+	int block;	// -1 when the buffer holds nothing
+	int prev, next;	// LRU list
+	int hnext;	// hash chain
+	char *data;
+} Buffer;
+
+/*
+ * Threads sharing a disk: in DISK_MMAP and DISK_MEMORY mode reads and
+ * writes go straight to memory, and callers keep two threads off the
+ * same block; only the dirty map is shared, and it changes atomically.
+ * In DISK_MMAP mode a dirty block lives in the shadow until disk_sync()
+ * copies it into the mapping, before clearing its dirty bit, so a sync
+ * must not run alongside writes to the blocks it writes back.
+ * The buffer cache is taken as a whole, so in DISK_CACHE mode every call
+ * holds the disk lock. The lock is recursive, which lets the write-back
+ * hook and callers building on several calls (the journal) hold it too.
+ */
+struct Disk {
+	char (*disk)[BLOCK_SIZE];	// the mapping, or the image read into memory
+	char (*shadow)[BLOCK_SIZE];	// DISK_MMAP: dirty blocks, kept out of the mapping
+	DISK_MODE mode;
+	int fd;
+	pthread_mutex_t lock;
+
+	// one bit per block, set by disk_write() and cleared once written back
+	unsigned char dirtyMap[MAX_BLOCK / 8];
+
+	// called before dirty blocks go back to the image, see disk_set_writeback_hook()
+	void (*writebackHook)(int block);
+
+	int cacheSize;
+	Buffer *cache;
+	char *cacheData;
+	int *cacheHash;
+	int hashMask;
+	int lruHead, lruTail;
+	DiskStats stats;
+	DiskIoStats io;
+
+	struct iovec iov[IOV_MAX];	// scratch for flush_run()
+};
+
+// the disk the calling thread works on, see disk_bind()
+static __thread Disk *cur;
+
+static int is_dirty(int block)
+{
+	return 1 & (__atomic_load_n(&cur->dirtyMap[block/8], __ATOMIC_RELAXED) >> (block % 8));
+}
+
+static void set_dirty(int block, int value)
+{
+	if(value) __atomic_fetch_or(&cur->dirtyMap[block/8], 1 << (block % 8), __ATOMIC_RELAXED);
+	else __atomic_fetch_and(&cur->dirtyMap[block/8], ~(1 << (block % 8)), __ATOMIC_RELAXED);
+}
+
+// where block is held outside DISK_CACHE mode
+static char *stored(int block)
+{
+	return cur->mode == DISK_MMAP && is_dirty(block) ? cur->shadow[block] : cur->disk[block];
+}
+
+// how many of the count blocks from block on are held one after the other, up to count
+static int stored_run(int block, int count)
+{
+	int n, dirty = is_dirty(block);
+
+	if(cur->mode != DISK_MMAP) return count;
+	for(n = 1; n < count && is_dirty(block + n) == dirty; n++)
+		;
+	return n;
+}
+
+// count one call moving blocks blocks; cheap enough to leave on
+static void count_io(long *calls, long *bytes, int blocks)
+{
+	__atomic_fetch_add(calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(bytes, (long)blocks * BLOCK_SIZE, __ATOMIC_RELAXED);
+}
+
+void disk_lock()
+{
+	pthread_mutex_lock(&cur->lock);
+}
+
+void disk_unlock()
+{
+	pthread_mutex_unlock(&cur->lock);
+}
+
+// wait on cond with the disk lock, held once, let go of meanwhile
+void disk_wait(pthread_cond_t *cond)
+{
+	pthread_cond_wait(cond, &cur->lock);
+}
+
+static void cache_lock()
+{
+	if(cur->mode == DISK_CACHE) pthread_mutex_lock(&cur->lock);
+}
+
+static void cache_unlock()
+{
+	if(cur->mode == DISK_CACHE) pthread_mutex_unlock(&cur->lock);
+}
+
+static void lru_unlink(int b)
+{
+	if(cur->cache[b].prev >= 0) cur->cache[cur->cache[b].prev].next = cur->cache[b].next;
+	else cur->lruHead = cur->cache[b].next;
+	if(cur->cache[b].next >= 0) cur->cache[cur->cache[b].next].prev = cur->cache[b].prev;
+	else cur->lruTail = cur->cache[b].prev;
+}
+
+static void lru_push(int b)
+{
+	cur->cache[b].prev = -1;
+	cur->cache[b].next = cur->lruHead;
+	if(cur->lruHead >= 0) cur->cache[cur->lruHead].prev = b;
+	cur->lruHead = b;
+	if(cur->lruTail < 0) cur->lruTail = b;
+}
+
+static int cache_lookup(int block)
+{
+	int b;
+	for(b = cur->cacheHash[block & cur->hashMask]; b >= 0; b = cur->cache[b].hnext)
+		if(cur->cache[b].block == block) return b;
+	return -1;
+}
+
+static void hash_remove(int b)
+{
+	int *p = &cur->cacheHash[cur->cache[b].block & cur->hashMask];
+	while(*p != b) p = &cur->cache[*p].hnext;
+	*p = cur->cache[b].hnext;
+}
+
+/*
+ * Return the buffer holding block, reading it from the image when load
+ * is set. Only a full-block overwrite passes load == 0.
+ */
+static int cache_get(int block, int load)
+{
+	int b = cache_lookup(block);
+
+	if(b >= 0) {
+		cur->stats.hits++;
+		lru_unlink(b);
+		lru_push(b);
+		return b;
+	}
+
+	cur->stats.misses++;
+	b = cur->lruTail;
+	if(cur->cache[b].block >= 0) {
+		int old = cur->cache[b].block;
+		if(is_dirty(old) && cur->writebackHook != NULL) {
+			// the hook may sync, writing the victim back itself
+			cur->writebackHook(old);
+		}
+		if(is_dirty(old)) {
+			if(pwrite(cur->fd, cur->cache[b].data, BLOCK_SIZE, (off_t)old * BLOCK_SIZE) != BLOCK_SIZE)
+				fprintf(stderr, "disk cache: write back of block %d failed\n", old);
+			set_dirty(old, 0);
+			cur->stats.writebacks++;
+		}
+		hash_remove(b);
+		cur->stats.evictions++;
+	}
+
+	cur->cache[b].block = block;
+	cur->cache[b].hnext = cur->cacheHash[block & cur->hashMask];
+	cur->cacheHash[block & cur->hashMask] = b;
+	lru_unlink(b);
+	lru_push(b);
+
+	if(load) {
+		ssize_t n = pread(cur->fd, cur->cache[b].data, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+		if(n < 0) n = 0;
+		if(n < BLOCK_SIZE) memset(cur->cache[b].data + n, 0, BLOCK_SIZE - n);
+	}
+	return b;
+}
+
+static int cache_init()
+{
+	int i, buckets = 1;
+
+	while(buckets < cur->cacheSize) buckets <<= 1;
+	cur->cache = malloc(sizeof(Buffer) * cur->cacheSize);
+	cur->cacheData = malloc((size_t)cur->cacheSize * BLOCK_SIZE);
+	cur->cacheHash = malloc(sizeof(int) * buckets);
+	if(cur->cache == NULL || cur->cacheData == NULL || cur->cacheHash == NULL) return -1;
+
+	cur->hashMask = buckets - 1;
+	for(i = 0; i < buckets; i++) cur->cacheHash[i] = -1;
+	cur->lruHead = cur->lruTail = -1;
+	for(i = cur->cacheSize - 1; i >= 0; i--) {
+		cur->cache[i].block = -1;
+		cur->cache[i].hnext = -1;
+		cur->cache[i].data = cur->cacheData + (size_t)i * BLOCK_SIZE;
+		lru_push(i);
+	}
+	memset(&cur->stats, 0, sizeof(cur->stats));
+	cur->stats.size = cur->cacheSize;
+	return 0;
+}
+
+static void cache_free()
+{
+	free(cur->cache);
+	free(cur->cacheData);
+	free(cur->cacheHash);
+	cur->cache = NULL;
+	cur->cacheData = NULL;
+	cur->cacheHash = NULL;
+}
+
 int disk_read(int block, char *buf)
 {
 	if(block < 0 || block >= MAX_BLOCK) {
 		printf("disk_read error\n");
 		return -1;
 	}
-	memcpy(buf, disk[block], BLOCK_SIZE);
+	count_io(&cur->io.reads, &cur->io.readBytes, 1);
+	if(cur->mode == DISK_CACHE) {
+		cache_lock();
+		memcpy(buf, cur->cache[cache_get(block, 1)].data, BLOCK_SIZE);
+		cache_unlock();
+	} else {
+		memcpy(buf, stored(block), BLOCK_SIZE);
+	}
 
 	return 0;
 }
 
+/*
+ * Read count consecutive blocks into buf with a single copy, or in cache
+ * mode a single pread() per stretch of blocks that are not cached.
+ */
+int disk_read_blocks(int block, int count, char *buf)
+{
+	int i, n, start;
+
+	if(block < 0 || count < 0 || block + count > MAX_BLOCK) {
+		printf("disk_read error\n");
+		return -1;
+	}
+	count_io(&cur->io.reads, &cur->io.readBytes, count);
+	if(cur->mode != DISK_CACHE) {
+		for(i = 0; i < count; i += n) {
+			n = stored_run(block + i, count - i);
+			memcpy(buf + (size_t)i * BLOCK_SIZE, stored(block + i), (size_t)n * BLOCK_SIZE);
+		}
+		return 0;
+	}
+
+	cache_lock();
+	for(i = 0; i < count; ) {
+		int b = cache_lookup(block + i);
+		if(b >= 0) {
+			memcpy(buf + (size_t)i * BLOCK_SIZE, cur->cache[cache_get(block + i, 1)].data, BLOCK_SIZE);
+			i++;
+			continue;
+		}
+		// uncached blocks are read around the cache so a big file does not flush it
+		for(start = i; i < count && cache_lookup(block + i) < 0; i++)
+			cur->stats.misses++;
+		size_t len = (size_t)(i - start) * BLOCK_SIZE;
+		ssize_t n = pread(cur->fd, buf + (size_t)start * BLOCK_SIZE, len, (off_t)(block + start) * BLOCK_SIZE);
+		if(n < 0) n = 0;
+		if(n < len) memset(buf + (size_t)start * BLOCK_SIZE + n, 0, len - n);
+	}
+	cache_unlock();
+	return 0;
+}
+
+/*
+ * Hand out a pointer to the stored contents of block instead of copying
+ * it. On entry *count is how many consecutive blocks the caller wants; it
+ * is cut down to how many of them follow block contiguously in memory.
+ * The pointer is read-only and only valid until disk_peek_done(), which
+ * has to follow every peek that did not return NULL; in DISK_CACHE mode
+ * the disk stays locked in between so the buffer is not recycled.
+ */
+char *disk_peek(int block, int *count)
+{
+	if(block < 0 || block >= MAX_BLOCK || *count < 1) {
+		printf("disk_read error\n");
+		return NULL;
+	}
+	if(block + *count > MAX_BLOCK) *count = MAX_BLOCK - block;
+	if(cur->mode != DISK_CACHE) {
+		*count = stored_run(block, *count);
+		count_io(&cur->io.reads, &cur->io.readBytes, *count);
+		return stored(block);
+	}
+
+	*count = 1;
+	count_io(&cur->io.reads, &cur->io.readBytes, 1);
+	cache_lock();
+	return cur->cache[cache_get(block, 1)].data;
+}
+
+void disk_peek_done()
+{
+	cache_unlock();
+}
+
+/*
+ * Store a block. Returns 1 when the stored contents changed, 0 when buf
+ * matched them already and -1 on a bad block number.
+ */
 int disk_write(int block, char *buf)
 {
+	char *dst;
+
 	if(block < 0 || block >= MAX_BLOCK) {
 		printf("disk_write error\n");
 		return -1;
 	}
-	memcpy(disk[block], buf, BLOCK_SIZE);
+	count_io(&cur->io.writes, &cur->io.writeBytes, 1);
+	cache_lock();
+	if(cur->mode == DISK_CACHE) {
+		int cached = cache_lookup(block) >= 0;
+		dst = cur->cache[cache_get(block, cached)].data;
+		if(!cached) {
+			// nothing to compare against without reading the block
+			memcpy(dst, buf, BLOCK_SIZE);
+			set_dirty(block, 1);
+			cache_unlock();
+			return 1;
+		}
+	} else {
+		dst = stored(block);
+	}
+	// rewriting a block with its current contents does not dirty it
+	if(memcmp(dst, buf, BLOCK_SIZE) == 0) {
+		cache_unlock();
+		return 0;
+	}
+	if(cur->mode == DISK_MMAP) dst = cur->shadow[block];
+	memcpy(dst, buf, BLOCK_SIZE);
+	set_dirty(block, 1);
+	cache_unlock();
 
+	return 1;
+}
+
+/*
+ * Write count blocks straight to the image and wait until they are on
+ * stable storage, bypassing the dirty map. Any stored copy of the blocks
+ * is updated too. Meant for log records, which have to be durable before
+ * the blocks they describe are written back.
+ */
+int disk_write_through(int block, int count, char *buf)
+{
+	size_t len = (size_t)count * BLOCK_SIZE;
+	int i;
+
+	if(block < 0 || count < 0 || block + count > MAX_BLOCK || cur->fd < 0) {
+		printf("disk_write error\n");
+		return -1;
+	}
+	count_io(&cur->io.writes, &cur->io.writeBytes, count);
+	if(pwrite(cur->fd, buf, len, (off_t)block * BLOCK_SIZE) != len) return -1;
+	if(fdatasync(cur->fd) < 0) return -1;
+
+	cache_lock();
+	for(i = 0; i < count; i++) {
+		// a shared mapping already sees the write, and a shadow copy goes with the dirty bit
+		if(cur->mode == DISK_MEMORY)
+			memcpy(cur->disk[block + i], buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+		else if(cur->mode == DISK_CACHE && cache_lookup(block + i) >= 0)
+			memcpy(cur->cache[cache_lookup(block + i)].data, buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+		set_dirty(block + i, 0);
+	}
+	cache_unlock();
 	return 0;
 }
 
-int disk_mount(char *name)
+/*
+ * Install a function that runs before dirty blocks are written back: with
+ * the block number for a cache eviction, with -1 for disk_sync(). From an
+ * eviction it may use disk_write_through() and disk_sync(), nothing that
+ * loads a block.
+ */
+void disk_set_writeback_hook(void (*hook)(int block))
+{
+	cur->writebackHook = hook;
+}
+
+// write back the dirty run [start, end), returns the number of writes issued
+static int flush_run(int start, int end)
+{
+	struct iovec *iov = cur->iov;
+	size_t len = (size_t)(end - start) * BLOCK_SIZE;
+	int writes = 0;
+
+	if(cur->mode == DISK_MMAP) {
+		// msync() wants a page-aligned start address
+		char *addr = cur->disk[start];
+		size_t skew = (size_t)(addr - (char *)cur->disk) % sysconf(_SC_PAGESIZE);
+		return msync(addr - skew, len + skew, MS_SYNC) < 0 ? -1 : 1;
+	}
+	if(cur->mode == DISK_MEMORY)
+		return pwrite(cur->fd, cur->disk[start], len, (off_t)start * BLOCK_SIZE) != len ? -1 : 1;
+
+	// dirty blocks are always cached, gather them into one pwritev()
+	while(start < end) {
+		int i, n = end - start < IOV_MAX ? end - start : IOV_MAX;
+		for(i = 0; i < n; i++) {
+			iov[i].iov_base = cur->cache[cache_lookup(start + i)].data;
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+		if(pwritev(cur->fd, iov, n, (off_t)start * BLOCK_SIZE) != (ssize_t)n * BLOCK_SIZE)
+			return -1;
+		start += n;
+		writes++;
+	}
+	return writes;
+}
+
+/*
+ * Write every dirty block back to the image, one write per run of adjacent
+ * dirty blocks. Returns the number of blocks written and the number of
+ * writes issued through *runs, or -1 on error.
+ */
+int disk_sync(int *runs)
+{
+	int block = 0, count = 0, nrun = 0;
+
+	if(cur->fd < 0) return -1;
+	disk_lock();
+	if(cur->writebackHook != NULL) cur->writebackHook(-1);
+
+	while(block < MAX_BLOCK) {
+		if(cur->dirtyMap[block/8] == 0) {
+			block = (block/8 + 1) * 8;
+			continue;
+		}
+		if(!is_dirty(block)) {
+			block++;
+			continue;
+		}
+
+		int start = block;
+		while(block < MAX_BLOCK && is_dirty(block)) block++;
+
+		// only now, once the journal has logged them, do changes go into the mapping
+		if(cur->mode == DISK_MMAP)
+			memcpy(cur->disk[start], cur->shadow[start], (size_t)(block - start) * BLOCK_SIZE);
+		// cleared first, so a block written meanwhile stays dirty
+		for(int i = start; i < block; i++)
+			set_dirty(i, 0);
+		int writes = flush_run(start, block);
+		if(writes < 0) {
+			for(int i = start; i < block; i++)
+				set_dirty(i, 1);
+			disk_unlock();
+			return -1;
+		}
+		count += block - start;
+		nrun += writes;
+	}
+	disk_unlock();
+	if(cur->mode != DISK_MMAP && count > 0 && fdatasync(cur->fd) < 0) return -1;
+	if(runs != NULL) *runs = nrun;
+	return count;
+}
+
+DISK_MODE disk_get_mode()
+{
+	return cur->mode;
+}
+
+void disk_cache_stats(DiskStats *out)
+{
+	cache_lock();
+	*out = cur->stats;
+	cache_unlock();
+}
+
+// the I/O counters, zeroed afterwards when reset is set
+void disk_io_stats(DiskIoStats *out, int reset)
+{
+	long *from = (long *)&cur->io, *to = (long *)out;
+	int i;
+
+	for(i = 0; i < sizeof(DiskIoStats) / sizeof(long); i++)
+		to[i] = reset ? __atomic_exchange_n(&from[i], 0, __ATOMIC_RELAXED)
+			: __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+// make d the disk that the calling thread's disk_* calls work on
+void disk_bind(Disk *d)
+{
+	cur = d;
+}
+
+static int disk_open(char *name, int *exists)
 {
-	FILE *fp = fopen(name, "r");
-	if(fp != NULL) {
-		fread(disk, BLOCK_SIZE, MAX_BLOCK, fp);
-		fclose(fp);
-		return 1;
+	struct stat st;
+
+	*exists = 1;
+	cur->fd = open(name, O_RDWR);
+	if(cur->fd < 0) {
+		cur->fd = open(name, O_RDWR | O_CREAT, 0644);
+		*exists = 0;
+	}
+	if(cur->fd < 0 || fstat(cur->fd, &st) < 0) {
+		fprintf(stderr, "disk_mount: file open error! %s\n", name);
+		return -1;
+	}
+	if(st.st_size < DISK_BYTES) {
+		if(st.st_size == 0) *exists = 0;
+		if(ftruncate(cur->fd, DISK_BYTES) < 0) {
+			fprintf(stderr, "disk_mount: cannot size %s\n", name);
+			return -1;
+		}
 	}
 	return 0;
 }
 
-int disk_umount(char *name)
+/*
+ * Map the image MAP_SHARED so mounting costs nothing up front: blocks are
+ * paged in on first disk_read() and only the dirty runs are msync()ed
+ * back. Whatever is in the mapping may reach the file at any time, even
+ * when the process is killed, so a block written since the last sync is
+ * held in the shadow instead, whose pages are only touched by writes.
+ */
+static int disk_mount_mmap()
 {
-	FILE *fp = fopen(name, "w");
-	if(fp == NULL) {
-		fprintf(stderr, "disk_umount: file open error! %s\n", name);
+	void *map = mmap(NULL, DISK_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, cur->fd, 0);
+	if(map != MAP_FAILED && (cur->shadow = malloc(DISK_BYTES)) == NULL) munmap(map, DISK_BYTES);
+	if(map == MAP_FAILED || cur->shadow == NULL) {
+		fprintf(stderr, "disk_mount: mmap failed, reading image into memory\n");
+		cur->mode = DISK_MEMORY;
 		return -1;
 	}
+	cur->disk = map;
+	return 0;
+}
 
-	fwrite(disk, BLOCK_SIZE, MAX_BLOCK, fp);
-	fclose(fp);
-	return 1;
+/*
+ * Open an image in the given mode and bind it to the calling thread. A
+ * missing image is created and sized here, and *exists is cleared so the
+ * caller formats it. cacheBlocks only matters in DISK_CACHE mode, 0 picks
+ * the default. Returns NULL when the image cannot be opened.
+ */
+Disk *disk_mount(char *name, DISK_MODE mode, int cacheBlocks, int *exists)
+{
+	Disk *d = calloc(1, sizeof(Disk));
+
+	if(d == NULL) return NULL;
+	d->mode = mode;
+	d->fd = -1;
+	d->cacheSize = cacheBlocks > 0 ? cacheBlocks : DEFAULT_CACHE_BLOCKS;
+	d->lruHead = d->lruTail = -1;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&d->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	cur = d;
+	if(disk_open(name, exists) < 0) {
+		if(d->fd >= 0) close(d->fd);
+		pthread_mutex_destroy(&d->lock);
+		free(d);
+		cur = NULL;
+		return NULL;
+	}
+
+	if(d->mode == DISK_CACHE) {
+		if(cache_init() == 0) return d;
+		fprintf(stderr, "disk_mount: cannot allocate %d cache blocks\n", d->cacheSize);
+		cache_free();
+		d->mode = DISK_MMAP;
+	}
+
+	if(d->mode == DISK_MMAP && disk_mount_mmap() == 0)
+		return d;
+
+	d->disk = malloc(DISK_BYTES);
+	if(d->disk == NULL || (*exists && pread(d->fd, d->disk, DISK_BYTES, 0) != DISK_BYTES)) {
+		fprintf(stderr, "disk_mount: short read! %s\n", name);
+		free(d->disk);
+		close(d->fd);
+		pthread_mutex_destroy(&d->lock);
+		free(d);
+		cur = NULL;
+		return NULL;
+	}
+	if(!*exists) memset(d->disk, 0, DISK_BYTES);
+	return d;
 }
 
+// write everything back and release the disk
+int disk_umount(Disk *d)
+{
+	int ret = 1;
+
+	cur = d;
+	if(disk_sync(NULL) < 0) {
+		fprintf(stderr, "disk_umount: write error!\n");
+		ret = -1;
+	}
+	if(d->mode == DISK_CACHE) cache_free();
+	else if(d->mode == DISK_MMAP) {
+		munmap(d->disk, DISK_BYTES);
+		free(d->shadow);
+	} else free(d->disk);
+	if(d->fd >= 0) close(d->fd);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+	cur = NULL;
+	return ret;
+}
@@ -1,11 +1,53 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <pthread.h>
+
 #define BLOCK_SIZE 512
 #define MAX_BLOCK 4096
+#define DEFAULT_CACHE_BLOCKS 256
+
+typedef enum {DISK_MMAP, DISK_MEMORY, DISK_CACHE} DISK_MODE;
+
+/*
+ * One open image. The block calls below work on the disk last bound to
+ * the calling thread with disk_bind() (disk_mount() binds the new disk).
+ */
+typedef struct Disk Disk;
+
+typedef struct {
+		int size; // cache capacity in blocks
+		long hits;
+		long misses;
+		long evictions;
+		long writebacks; // dirty buffers written out on eviction
+} DiskStats;
 
-extern char disk[MAX_BLOCK][BLOCK_SIZE];
+// block traffic through the calls below, kept in every mode
+typedef struct {
+		long reads; // disk_read(), disk_read_blocks() and disk_peek() calls
+		long readBytes;
+		long writes; // disk_write() and disk_write_through() calls
+		long writeBytes;
+} DiskIoStats;
 
 int disk_read(int block, char *buf);
+int disk_read_blocks(int block, int count, char *buf);
+char *disk_peek(int block, int *count);
+void disk_peek_done();
 int disk_write(int block, char *buf);
+int disk_write_through(int block, int count, char *buf);
+int disk_sync(int *runs);
+void disk_set_writeback_hook(void (*hook)(int block));
+void disk_lock();
+void disk_unlock();
+void disk_wait(pthread_cond_t *cond);
 
-int disk_mount(char *name);
-int disk_umount(char *name);
+DISK_MODE disk_get_mode();
+void disk_cache_stats(DiskStats *out);
+void disk_io_stats(DiskIoStats *out, int reset);
+void disk_bind(Disk *d);
+Disk *disk_mount(char *name, DISK_MODE mode, int cacheBlocks, int *exists);
+int disk_umount(Disk *d);
 
+#endif
@@ -1,384 +1,1291 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include "fs.h"
+#include "fs_internal.h"
 #include "fs_util.h"
-#include "disk.h"
 
-char inodeMap[MAX_INODE / 8];
-char blockMap[MAX_BLOCK / 8];
-Inode inode[MAX_INODE];
-SuperBlock superBlock;
-Dentry curDir;
-int curDirBlock;
+__thread FileSystem *fs; // the image this thread is working on
+
+/*
+ * Pointer blocks read by bmap(). A sequential read walks the same
+ * indirect block for PTRS_PER_BLOCK data blocks in a row, so the last few
+ * are kept rather than fetched again for every data block. Block 0 is
+ * the superblock and never a pointer block, so it marks a free slot. The
+ * cache is per thread and emptied by every call: the lock on the file a
+ * call works on is what keeps its pointer blocks from changing.
+ */
+#define PTR_CACHE_SIZE 4
+static __thread struct {
+	int block;
+	int ptr[PTRS_PER_BLOCK];
+} ptrCache[PTR_CACHE_SIZE];
+static __thread int ptrCacheNext;
+
+static void ptr_cache_reset() {
+	int i;
+
+	for (i = 0; i < PTR_CACHE_SIZE; i++)
+		ptrCache[i].block = 0;
+	ptrCacheNext = 0;
+} // ptr_cache_reset()
+
+// make image the one the internals below work on, for this thread
+void fs_bind(FileSystem *image) {
+	fs = image;
+	disk_bind(image->disk);
+	ptr_cache_reset();
+} // fs_bind()
+
+/*
+ * Inode table. An inode block is read the first time one of its inodes
+ * is asked for, not at mount, and fs_flush() writes back only the blocks
+ * holding an inode that was fetched with iget_dirty().
+ */
+static void inode_cache_reset(int loaded) {
+	memset(fs->inodeLoaded, loaded ? 0xff : 0, sizeof(fs->inodeLoaded));
+	memset(fs->inodeDirty, 0, sizeof(fs->inodeDirty));
+	memset(fs->inodeAtime, 0, sizeof(fs->inodeAtime));
+} // inode_cache_reset()
+
+// return inode n, reading its block in on first use
+Inode *iget(int n) {
+	int block = n / INODES_PER_BLOCK;
+
+	if (!get_bit_atomic(fs->inodeLoaded, block)) {
+		pthread_mutex_lock(&fs->inodeLoadLock);
+		if (!get_bit(fs->inodeLoaded, block)) {
+			disk_read(INODE_START + block, (char *)(fs->inode + block * INODES_PER_BLOCK));
+			set_bit_atomic(fs->inodeLoaded, block, 1);
+		} // if
+		pthread_mutex_unlock(&fs->inodeLoadLock);
+	} // if
+	return &fs->inode[n];
+} // iget()
+
+// iget() for an inode the caller is about to change
+Inode *iget_dirty(int n) {
+	set_bit_atomic(fs->inodeDirty, n / INODES_PER_BLOCK, 1);
+	return iget(n);
+} // iget_dirty()
+
+/*
+ * Set the access time of an inode the caller holds only a shared lock
+ * on. Readers of one file may race here; each field is stored whole,
+ * and a transaction copying the inode block meanwhile may log the two
+ * fields from different calls, which is harmless for an access time.
+ */
+static void touch_atime(int n) {
+	struct timeval now;
+	Inode *node = iget(n);
+
+	gettimeofday(&now, NULL);
+	__atomic_store_n(&node->lastAccess.tv_sec, now.tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&node->lastAccess.tv_usec, now.tv_usec, __ATOMIC_RELAXED);
+	set_bit_atomic(fs->inodeAtime, n / INODES_PER_BLOCK, 1);
+} // touch_atime()
+
+static void ilock_read(int n) {
+	pthread_rwlock_rdlock(&fs->inodeLock[n]);
+} // ilock_read()
+
+static void ilock_write(int n) {
+	pthread_rwlock_wrlock(&fs->inodeLock[n]);
+} // ilock_write()
+
+static void iunlock(int n) {
+	pthread_rwlock_unlock(&fs->inodeLock[n]);
+} // iunlock()
+
+static int *read_ptr_block(int block) {
+	int i;
+
+	for (i = 0; i < PTR_CACHE_SIZE; i++) {
+		if (ptrCache[i].block == block)
+			return ptrCache[i].ptr;
+	} // for
+	i = ptrCacheNext;
+	ptrCacheNext = (ptrCacheNext + 1) % PTR_CACHE_SIZE;
+	ptrCache[i].block = block;
+	disk_read(block, (char *)ptrCache[i].ptr);
+	return ptrCache[i].ptr;
+} // read_ptr_block()
+
+static void forget_ptr_block(int block) {
+	int i;
+
+	for (i = 0; i < PTR_CACHE_SIZE; i++) {
+		if (ptrCache[i].block == block)
+			ptrCache[i].block = 0;
+	} // for
+} // forget_ptr_block()
+
+// get a zeroed pointer block, or 0 when the disk is full
+static int new_ptr_block() {
+	int ptr[PTRS_PER_BLOCK] = {0};
+	int block = get_free_block();
+
+	if (block < 0)
+		return 0;
+	forget_ptr_block(block);
+	journal_write(block, (char *)ptr);
+	return block;
+} // new_ptr_block()
+
+// blocks a file of size bytes spans, holes included
+static int size_blocks(int size) {
+	return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+} // size_blocks()
+
+// pointer blocks a file of numBlock data blocks needs on top of its data
+static int ptr_blocks_needed(int numBlock) {
+	int n = numBlock - DIRECT_BLOCKS;
+
+	if (n <= 0)
+		return 0;
+	if (n <= PTRS_PER_BLOCK)
+		return 1;
+	n -= PTRS_PER_BLOCK;
+	return 2 + (n + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+} // ptr_blocks_needed()
+
+// pointer blocks that mapping blocks [first, last) of a file would add
+static int ptr_blocks_missing(Inode *node, int first, int last) {
+	int per = PTRS_PER_BLOCK;
+	int n = 0, g;
+
+	if (last > DIRECT_BLOCKS && first < DIRECT_BLOCKS + per && node->indirectBlock == 0)
+		n++;
+	first -= DIRECT_BLOCKS + per;
+	last -= DIRECT_BLOCKS + per;
+	if (last <= 0)
+		return n;
+	if (first < 0)
+		first = 0;
+	if (node->doubleIndirectBlock == 0)
+		return n + 1 + (last - 1) / per - first / per + 1;
+	for (g = first / per; g <= (last - 1) / per; g++) {
+		if (read_ptr_block(node->doubleIndirectBlock)[g] == 0)
+			n++;
+	} // for
+	return n;
+} // ptr_blocks_missing()
+
+// block number of the file's i-th data block, 0 for a hole
+int bmap(Inode *node, int i) {
+	if (i < DIRECT_BLOCKS)
+		return node->directBlock[i];
+	i -= DIRECT_BLOCKS;
+	if (i < PTRS_PER_BLOCK)
+		return node->indirectBlock ? read_ptr_block(node->indirectBlock)[i] : 0;
+	i -= PTRS_PER_BLOCK;
+	if (node->doubleIndirectBlock == 0)
+		return 0;
+	int indirect = read_ptr_block(node->doubleIndirectBlock)[i / PTRS_PER_BLOCK];
+	return indirect ? read_ptr_block(indirect)[i % PTRS_PER_BLOCK] : 0;
+} // bmap()
+
+// store block into one slot of a pointer block, keeping the cache current
+static void set_ptr(int ptrBlock, int i, int block) {
+	int *ptr = read_ptr_block(ptrBlock);
+
+	ptr[i] = block;
+	journal_write(ptrBlock, (char *)ptr);
+} // set_ptr()
+
+// make block the file's i-th data block, adding pointer blocks as needed
+static int bmap_set(Inode *node, int i, int block) {
+	if (i < DIRECT_BLOCKS) {
+		node->directBlock[i] = block;
+		return 0;
+	} // if
+	i -= DIRECT_BLOCKS;
+	if (i < PTRS_PER_BLOCK) {
+		if (node->indirectBlock == 0 && (node->indirectBlock = new_ptr_block()) == 0)
+			return -1;
+		set_ptr(node->indirectBlock, i, block);
+		return 0;
+	} // if
+	i -= PTRS_PER_BLOCK;
+	if (node->doubleIndirectBlock == 0 && (node->doubleIndirectBlock = new_ptr_block()) == 0)
+		return -1;
+	int indirect = read_ptr_block(node->doubleIndirectBlock)[i / PTRS_PER_BLOCK];
+	if (indirect == 0) {
+		if ((indirect = new_ptr_block()) == 0)
+			return -1;
+		set_ptr(node->doubleIndirectBlock, i / PTRS_PER_BLOCK, indirect);
+	} // if
+	set_ptr(indirect, i % PTRS_PER_BLOCK, block);
+	return 0;
+} // bmap_set()
+
+static void free_ptr_block(int block) {
+	forget_ptr_block(block);
+	set_free_block(block);
+} // free_ptr_block()
+
+// zero the slots of a pointer block from the from-th on
+static void clear_ptrs(int ptrBlock, int from) {
+	int *ptr = read_ptr_block(ptrBlock);
+
+	memset(ptr + from, 0, (PTRS_PER_BLOCK - from) * sizeof(int));
+	journal_write(ptrBlock, (char *)ptr);
+} // clear_ptrs()
+
+/*
+ * Free the data blocks of a file from its span-th block on, and the
+ * pointer blocks that are left mapping none of the rest. Holes have
+ * nothing to free, and a block another file shares only loses an owner.
+ * node->size is still the old size.
+ */
+static void truncate_blocks(Inode *node, int span) {
+	int per = PTRS_PER_BLOCK;
+	int i, end = size_blocks(node->size);
+
+	for (i = span; i < end; i++) {
+		int block = bmap(node, i);
+		if (block > 0) {
+			put_block(block);
+			node->blockCount--;
+		} // if
+	} // for
+	for (i = span; i < DIRECT_BLOCKS; i++)
+		node->directBlock[i] = 0;
+
+	if (node->indirectBlock) {
+		if (span <= DIRECT_BLOCKS) {
+			free_ptr_block(node->indirectBlock);
+			node->indirectBlock = 0;
+		} else if (span < DIRECT_BLOCKS + per)
+			clear_ptrs(node->indirectBlock, span - DIRECT_BLOCKS);
+	} // if
 
-int fs_mount(char *name) {
-	int numInodeBlock = (sizeof(Inode) * MAX_INODE) / BLOCK_SIZE;
-	int i, index, inode_index = 0;
+	if (node->doubleIndirectBlock) {
+		int first = span - DIRECT_BLOCKS - per;
+		if (first <= 0) {
+			int *ptr = read_ptr_block(node->doubleIndirectBlock);
+			for (i = 0; i < per; i++) {
+				if (ptr[i])
+					free_ptr_block(ptr[i]);
+			} // for
+			free_ptr_block(node->doubleIndirectBlock);
+			node->doubleIndirectBlock = 0;
+			return;
+		} // if
+		// keep the indirect block the new end falls in, cut down to size
+		int g = first / per;
+		int indirect = read_ptr_block(node->doubleIndirectBlock)[g];
+		if (first % per > 0) {
+			if (indirect)
+				clear_ptrs(indirect, first % per);
+			g++;
+		} // if
+		// read again, clear_ptrs() may have pushed it out of the cache
+		int *ptr = read_ptr_block(node->doubleIndirectBlock);
+		for (i = g; i < per; i++) {
+			if (ptr[i]) {
+				free_ptr_block(ptr[i]);
+				ptr[i] = 0;
+			} // if
+		} // for
+		journal_write(node->doubleIndirectBlock, (char *)ptr);
+	} // if
+} // truncate_blocks()
+
+// free the data blocks of a file and the pointer blocks that map them
+static void free_file_blocks(Inode *node) {
+	if (node->flags & INODE_INLINE) {
+		memset(node->inlineData, 0, INLINE_SIZE);
+		node->flags &= ~INODE_INLINE;
+		return;
+	} // if
+	truncate_blocks(node, 0);
+	node->blockCount = 0;
+} // free_file_blocks()
+
+/*
+ * Move the data of an inline file out to a block of its own, as it grows
+ * past INLINE_SIZE. Returns -1 when there is no block for it, and the
+ * file stays as it was.
+ */
+static int uninline(Inode *node) {
+	char buf[BLOCK_SIZE] = {0};
+	int block = 0;
+
+	if (node->size > 0) {
+		if ((block = get_free_block()) < 0)
+			return -1;
+		memcpy(buf, node->inlineData, node->size);
+		journal_write_data(block, buf);
+	} // if
+	memset(node->directBlock, 0, sizeof(node->directBlock));
+	node->directBlock[0] = block;
+	node->blockCount = block > 0;
+	node->flags &= ~INODE_INLINE;
+	return 0;
+} // uninline()
+
+/*
+ * Push the in-memory metadata into the block store: the superblock, both
+ * bitmaps, and the inode and reference count blocks that were changed
+ * since the last flush.
+ * Everything goes through the journal, in the room the transactions
+ * reserved for it; inode blocks only readers changed come last, and when
+ * the group has no room left for them it is committed first.
+ * Runs with txLock held exclusive, or before any other thread has the
+ * image, so every transaction begun has made all its changes; readers may
+ * still dirty an inode block meanwhile, so each dirty bit is cleared
+ * before its block is copied.
+ */
+static void fs_flush() {
+	SuperBlock sb;
+	char map[BLOCK_SIZE];
+	int i;
 
-	// load superblock, inodeMap, blockMap and inodes into the memory
-	if (disk_mount(name) == 1)
+	// blocks reserved by the allocator are free on disk
+	alloc_persist(&sb, map);
+	journal_write(0, (char *)&sb);
+	journal_write(1, fs->inodeMap);
+	journal_write(2, map);
+	for (i = 0; i < INODE_BLOCKS; i++)
 	{
-		disk_read(0, (char *)&superBlock);
-		if (superBlock.magicNumber != MAGIC_NUMBER)
-		{
-			printf("Invalid disk!\n");
-			exit(0);
-		}
-		disk_read(1, inodeMap);
-		disk_read(2, blockMap);
-		for (i = 0; i < numInodeBlock; i++)
-		{
-			index = i + 3;
-			disk_read(index, (char *)(inode + inode_index));
-			inode_index += (BLOCK_SIZE / sizeof(Inode));
-		}
-		// root directory
-		curDirBlock = inode[0].directBlock[0];
-		disk_read(curDirBlock, (char *)&curDir);
+		if (!get_bit_atomic(fs->inodeDirty, i))
+			continue;
+		set_bit_atomic(fs->inodeDirty, i, 0);
+		set_bit_atomic(fs->inodeAtime, i, 0);
+		journal_write(INODE_START + i, (char *)(fs->inode + i * INODES_PER_BLOCK));
+	}
+	for (i = 0; i < REF_BLOCKS && fs->superBlock.refStart > 0; i++) {
+		if (!get_bit_atomic(fs->refDirty, i))
+			continue;
+		set_bit_atomic(fs->refDirty, i, 0);
+		journal_write(fs->superBlock.refStart + i, (char *)fs->ref + i * BLOCK_SIZE);
+	}
+	for (i = 0; i < INODE_BLOCKS; i++) {
+		if (!get_bit_atomic(fs->inodeAtime, i))
+			continue;
+		if (journal_room() < 1)
+			journal_commit();
+		set_bit_atomic(fs->inodeAtime, i, 0);
+		journal_write(INODE_START + i, (char *)(fs->inode + i * INODES_PER_BLOCK));
+	}
+} // fs_flush()
+
+static __thread int txBlocks; // what the thread's call reserved in the journal
+
+/*
+ * Journal blocks a call may log besides the pointer blocks and reference
+ * counts of file data: the superblock, both bitmaps, three inode blocks
+ * and the directory blocks of an entry added or removed.
+ */
+#define TX_BLOCKS (3 + 3 + DIR_TX_BLOCKS)
+
+// the most pointer blocks a run of n data blocks can be mapped through
+static int ptr_blocks_touched(int n) {
+	if (n <= 0)
+		return 0;
+	return 2 + (n + PTRS_PER_BLOCK - 2) / PTRS_PER_BLOCK + 1;
+} // ptr_blocks_touched()
+
+// journal blocks for a call that maps or frees a run of n data blocks another file may share
+static int file_tx_blocks(int n) {
+	// more than the disk holds cannot be mapped, the call fails first
+	if (n > MAX_BLOCK)
+		n = MAX_BLOCK;
+	return TX_BLOCKS + ptr_blocks_touched(n) + (n < REF_BLOCKS ? n : REF_BLOCKS);
+} // file_tx_blocks()
+
+/*
+ * Start a call that changes the image, one that logs at most blocks
+ * journal blocks; it may wait here for the journal to make room.
+ */
+static void begin_op(FsClient *c, int blocks) {
+	fs_bind(c->image);
+	journal_begin(blocks);
+	txBlocks = blocks;
+	pthread_rwlock_rdlock(&fs->txLock);
+} // begin_op()
+
+/*
+ * Finish a call begun with begin_op(), once it has let go of its inode
+ * locks: every such call is one journal transaction.
+ */
+static int end_op(int ret) {
+	pthread_rwlock_unlock(&fs->txLock);
+	pthread_rwlock_wrlock(&fs->txLock);
+	fs_flush();
+	journal_end(txBlocks);
+	pthread_rwlock_unlock(&fs->txLock);
+	return ret;
+} // end_op()
+
+// load superblock, inodeMap and blockMap into the memory, inodes on demand
+static int fs_mount(int exists) {
+	int i;
+
+	if (exists)
+	{
+		disk_read(0, (char *)&fs->superBlock);
+		if (fs->superBlock.magicNumber != MAGIC_NUMBER)
+			return -1;
+		// finish what the last session committed before reading anything else
+		journal_replay();
+		disk_read(1, fs->inodeMap);
+		disk_read(2, fs->blockMap);
+		alloc_init();
+		ptr_cache_reset();
+		dir_cache_reset();
+		inode_cache_reset(0);
 	}
 	else
 	{
 		// Init file system superblock, inodeMap and blockMap
-		superBlock.magicNumber = MAGIC_NUMBER;
-		superBlock.freeBlockCount = MAX_BLOCK - (1 + 1 + 1 + numInodeBlock);
-		superBlock.freeInodeCount = MAX_INODE;
+		fs->superBlock.magicNumber = MAGIC_NUMBER;
+		fs->superBlock.freeBlockCount = MAX_BLOCK - (INODE_START + INODE_BLOCKS);
+		fs->superBlock.freeInodeCount = MAX_INODE;
+		fs->superBlock.journalStart = 0;
+		fs->superBlock.journalBlocks = 0;
+		fs->superBlock.journalSeq = 0;
+		fs->superBlock.refStart = 0;
+		fs->superBlock.refBlocks = 0;
 
 		//Init inodeMap
 		for (i = 0; i < MAX_INODE / 8; i++)
 		{
-			set_bit(inodeMap, i, 0);
+			set_bit(fs->inodeMap, i, 0);
 		}
 		//Init blockMap
 		for (i = 0; i < MAX_BLOCK / 8; i++)
 		{
-			if (i < (1 + 1 + 1 + numInodeBlock))
-				set_bit(blockMap, i, 1);
+			if (i < (INODE_START + INODE_BLOCKS))
+				set_bit(fs->blockMap, i, 1);
 			else
-				set_bit(blockMap, i, 0);
+				set_bit(fs->blockMap, i, 0);
 		}
+		alloc_init();
+		ptr_cache_reset();
+		dir_cache_reset();
+		// a fresh image has nothing to read, every inode starts out zeroed
+		memset(fs->inode, 0, sizeof(fs->inode));
+		inode_cache_reset(1);
+
 		//Init root dir
 		int rootInode = get_free_inode();
-		curDirBlock = get_free_block();
-
-		inode[rootInode].type = directory;
-		inode[rootInode].owner = 0;
-		inode[rootInode].group = 0;
-		gettimeofday(&(inode[rootInode].created), NULL);
-		gettimeofday(&(inode[rootInode].lastAccess), NULL);
-		inode[rootInode].size = 1;
-		inode[rootInode].blockCount = 1;
-		inode[rootInode].directBlock[0] = curDirBlock;
-
-		curDir.numEntry = 1;
-		strncpy(curDir.dentry[0].name, ".", 1);
-		curDir.dentry[0].name[1] = '\0';
-		curDir.dentry[0].inode = rootInode;
-		disk_write(curDirBlock, (char *)&curDir);
-	}
-	return 0;
-} // fs_mount()
 
-int fs_umount(char *name) {
-	int numInodeBlock = (sizeof(Inode) * MAX_INODE) / BLOCK_SIZE;
-	int i, index, inode_index = 0;
-	disk_write(0, (char *)&superBlock);
-	disk_write(1, inodeMap);
-	disk_write(2, blockMap);
-	for (i = 0; i < numInodeBlock; i++)
-	{
-		index = i + 3;
-		disk_write(index, (char *)(inode + inode_index));
-		inode_index += (BLOCK_SIZE / sizeof(Inode));
+		Inode *node = iget_dirty(rootInode);
+		node->type = directory;
+		node->owner = 0;
+		node->group = 0;
+		gettimeofday(&(node->created), NULL);
+		gettimeofday(&(node->lastAccess), NULL);
+		node->size = 1;
+		dir_init(rootInode, -1);
 	}
-	// current directory
-	disk_write(curDirBlock, (char *)&curDir);
 
-	disk_umount(name);
-} // fs_umount()
+	// a new log region and anything replayed go home before the first command
+	journal_init();
+	ref_init();
+	fs_flush();
+	journal_checkpoint(NULL);
+	return 0;
+} // fs_mount()
 
-int search_cur_dir(char *name) {
-	// return inode. If not exist, return -1
+// release what fs_open() set up besides the disk
+static void fs_close_locks(FileSystem *image) {
 	int i;
 
-	for (i = 0; i < curDir.numEntry; i++)
-	{
-		if (command(name, curDir.dentry[i].name))
-			return curDir.dentry[i].inode;
-	}
-	return -1;
-} // search_cur_dir()
-
-void remove_from_dir(char *name) {
-	int i;
+	dir_cache_destroy();
+	for (i = 0; i < MAX_INODE; i++)
+		pthread_rwlock_destroy(&image->inodeLock[i]);
+	pthread_rwlock_destroy(&image->txLock);
+	pthread_cond_destroy(&image->journal.room);
+	pthread_mutex_destroy(&image->clientLock);
+	pthread_mutex_destroy(&image->inodeLoadLock);
+} // fs_close_locks()
+
+/*
+ * Open an image, formatting it when the file is new or empty. Returns
+ * NULL when it cannot be opened or does not hold a file system.
+ */
+FileSystem *fs_open(char *name, DISK_MODE mode, int cacheBlocks) {
+	FileSystem *image = (FileSystem *)calloc(1, sizeof(FileSystem));
+	int exists, i;
+
+	if (image == NULL)
+		return NULL;
+	image->disk = disk_mount(name, mode, cacheBlocks, &exists);
+	if (image->disk == NULL) {
+		free(image);
+		return NULL;
+	} // if
 
-	// find the directory that will be removed 
-	for (i = 0; i < curDir.numEntry; i++) {
-		if (command(name, curDir.dentry[i].name)) {
+	pthread_mutex_init(&image->inodeLoadLock, NULL);
+	pthread_mutex_init(&image->clientLock, NULL);
+	pthread_rwlock_init(&image->txLock, NULL);
+	pthread_cond_init(&image->journal.room, NULL);
+	for (i = 0; i < MAX_INODE; i++)
+		pthread_rwlock_init(&image->inodeLock[i], NULL);
+	fs_bind(image);
+	dir_cache_init();
+
+	if (fs_mount(exists) < 0) {
+		disk_umount(image->disk);
+		fs_close_locks(image);
+		free(image);
+		fs = NULL;
+		return NULL;
+	} // if
+	return image;
+} // fs_open()
+
+/*
+ * Checkpoint and close an image; clients still open are freed with it.
+ * No other thread may be using the image any more.
+ */
+int fs_close(FileSystem *image) {
+	int ret;
+
+	fs_bind(image);
+	fs_flush();
+	journal_checkpoint(NULL);
+	ret = disk_umount(image->disk);
+	while (image->clients != NULL)
+		fs_client_free(image->clients);
+	fs_close_locks(image);
+	free(image);
+	fs = NULL;
+	return ret < 0 ? FS_EIO : 0;
+} // fs_close()
+
+// a new client of image, starting out in the root directory
+FsClient *fs_client(FileSystem *image) {
+	FsClient *c = (FsClient *)malloc(sizeof(FsClient));
+
+	if (c == NULL)
+		return NULL;
+	c->image = image;
+	c->cwd = ROOT_INODE;
+	pthread_mutex_lock(&image->clientLock);
+	c->next = image->clients;
+	image->clients = c;
+	pthread_mutex_unlock(&image->clientLock);
+	return c;
+} // fs_client()
+
+void fs_client_free(FsClient *c) {
+	FsClient **p;
+
+	pthread_mutex_lock(&c->image->clientLock);
+	for (p = &c->image->clients; *p != NULL; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
 			break;
 		} // if
 	} // for
+	pthread_mutex_unlock(&c->image->clientLock);
+	free(c);
+} // fs_client_free()
+
+FileSystem *fs_client_image(FsClient *c) {
+	return c->image;
+} // fs_client_image()
+
+// commit, then write every dirty block home; returns the block count
+int fs_sync(FileSystem *image, int *runs) {
+	int count;
+
+	fs_bind(image);
+	pthread_rwlock_wrlock(&fs->txLock);
+	fs_flush();
+	count = journal_checkpoint(runs);
+	pthread_rwlock_unlock(&fs->txLock);
+	return count < 0 ? FS_EIO : count;
+} // fs_sync()
+
+int fs_statfs(FileSystem *image, FsStatFs *st) {
+	JournalStats js;
+
+	fs_bind(image);
+	memset(st, 0, sizeof(FsStatFs));
+	st->freeBlocks = free_block_count();
+	st->freeInodes = free_inode_count();
+	dir_cache_stats(&st->dcacheHits, &st->dcacheMisses);
+	if (fs->superBlock.journalStart > 0) {
+		journal_stats(&js);
+		st->journalStart = fs->superBlock.journalStart;
+		st->journalBlocks = fs->superBlock.journalBlocks;
+		st->journalCommits = js.commits;
+		st->journalCheckpoints = js.checkpoints;
+		st->journalPending = js.pending;
+	} // if
+	if (fs->superBlock.refStart > 0) {
+		int i;
+		st->refStart = fs->superBlock.refStart;
+		for (i = 0; i < MAX_BLOCK; i++)
+			st->sharedBlocks += block_shared(i);
+	} // if
+	st->diskMode = disk_get_mode();
+	if (st->diskMode == DISK_CACHE)
+		disk_cache_stats(&st->cache);
+	return 0;
+} // fs_statfs()
 
-	// startign at the index of the file to be deleted, copy the items at the index over 
-	for (int j = i+1; j < curDir.numEntry; j++) {
-		// strncpy(curDir.dentry[i].name, curDir.dentry[j].name, strlen(curDir.dentry[j].name));
-		// curDir.dentry[j].name = curDir.dentry[i].name;
-		curDir.dentry[i] = curDir.dentry[j];
-		i++;
+// the I/O and allocator counters since the mount or the last reset
+int fs_perf(FileSystem *image, FsPerf *perf, int reset) {
+	fs_bind(image);
+	disk_io_stats(&perf->io, reset);
+	alloc_stats(perf, reset);
+	return 0;
+} // fs_perf()
+
+char *fs_strerror(int err) {
+	static char *msg[] = {
+		"success",
+		"no such file or directory",
+		"file exists",
+		"not a directory",
+		"is a directory",
+		"directory not empty",
+		"directory is in use",
+		"data block is full",
+		"inode is full",
+		"name must be 1 to 19 characters",
+		"directory is full",
+		"file too large",
+		"invalid argument",
+		"range is past the end of the file",
+		"write error",
+		"block shared by too many files",
+	};
+
+	if (err > 0 || -err >= sizeof(msg) / sizeof(msg[0]))
+		return "unknown error";
+	return msg[-err];
+} // fs_strerror()
+
+/*
+ * Take the next component of *path into comp, dropping "." components on
+ * the way. Returns 1, 0 at the end of the path, or -1 for a component too
+ * long to be a name.
+ */
+static int next_comp(char **path, char comp[MAX_FILE_NAME]) {
+	char *p = *path;
+	int len;
+
+	for (;;) {
+		while (*p == '/')
+			p++;
+		for (len = 0; p[len] != '\0' && p[len] != '/'; len++)
+			;
+		if (len == 0) {
+			*path = p;
+			return 0;
+		} // if
+		if (len == 1 && p[0] == '.') {
+			p++;
+			continue;
+		} // if
+		if (len >= MAX_FILE_NAME)
+			return -1;
+		memcpy(comp, p, len);
+		comp[len] = '\0';
+		*path = p + len;
+		return 1;
 	} // for
+} // next_comp()
 
-	// decrement the number of directory entries.
-	curDir.numEntry--;
-} // remove_from_dir()
+#define WALK_RETRY -100 // lookup_path() has to start over
 
-// Create a file 
-int file_create(char *name, int size) {
-	int i;
+static int walk(int cwd, char *path, int write) {
+	char comp[MAX_FILE_NAME];
+	int cur = *path == '/' ? ROOT_INODE : cwd;
+	int more = next_comp(&path, comp);
+	int next, up, last;
 
-	if (size > SMALL_FILE)
-	{
-		printf("Do not support files larger than %d bytes.\n", SMALL_FILE);
-		return -1;
-	}
+	if (more < 0)
+		return FS_ENOENT;
+	if (write && more == 0)
+		ilock_write(cur);
+	else
+		ilock_read(cur);
 
+	while (more > 0) {
+		if (iget(cur)->type != directory) {
+			iunlock(cur);
+			return FS_ENOTDIR;
+		} // if
+		up = strcmp(comp, "..") == 0;
+		next = cur == ROOT_INODE && up ? cur : dir_lookup(cur, comp);
+		if (next < 0) {
+			iunlock(cur);
+			return FS_ENOENT;
+		} // if
+		more = next_comp(&path, comp);
+		if (more < 0) {
+			iunlock(cur);
+			return FS_ENOENT;
+		} // if
+		last = write && more == 0;
+
+		if (next == cur) {
+			// ".." of the root, which never goes away while unlocked
+			if (last) {
+				iunlock(cur);
+				ilock_write(cur);
+			} // if
+			continue;
+		} // if
+		if (up) {
+			// a parent after its child is against the lock order
+			if ((last ? pthread_rwlock_trywrlock(&fs->inodeLock[next])
+					: pthread_rwlock_tryrdlock(&fs->inodeLock[next])) != 0) {
+				iunlock(cur);
+				return WALK_RETRY;
+			} // if
+		} else if (last)
+			ilock_write(next);
+		else
+			ilock_read(next);
+		iunlock(cur);
+		cur = next;
+	} // while
+	return cur;
+} // walk()
+
+/*
+ * Resolve a path to an inode and return it locked: shared, or exclusive
+ * when write is set. Absolute paths start at the root, anything else at
+ * cwd; "." and ".." are ordinary entries except that ".." of the root is
+ * the root itself. Locks are coupled down the path, the next inode locked
+ * before the current one is let go, so nothing on the way can be removed
+ * under the walk. ".." goes against the lock order and is only tried; if
+ * that fails the walk starts over.
+ */
+static int lookup_path(int cwd, char *path, int write) {
+	int ret;
+
+	if (*path == '\0')
+		return FS_ENOENT;
+	while ((ret = walk(cwd, path, write)) == WALK_RETRY)
+		sched_yield();
+	return ret;
+} // lookup_path()
+
+/*
+ * Resolve everything but the last component of a path and return the
+ * parent directory locked exclusive. The last component, trailing slashes
+ * dropped, is copied into leaf; path itself is left alone.
+ */
+static int lookup_parent(int cwd, char *path, char leaf[MAX_FILE_NAME]) {
+	char dir[MAX_PATH];
+	int len = strlen(path);
+	int start, parent;
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	for (start = len; start > 0 && path[start - 1] != '/'; start--)
+		;
+	if (len - start >= MAX_FILE_NAME || start >= MAX_PATH)
+		return FS_ENAME;
+	memcpy(leaf, path + start, len - start);
+	leaf[len - start] = '\0';
+
+	if (start == 0) {
+		ilock_write(cwd);
+		return cwd;
+	} // if
+	memcpy(dir, path, start);
+	dir[start] = '\0';
+	parent = lookup_path(cwd, dir, 1);
+	if (parent >= 0 && iget(parent)->type != directory) {
+		iunlock(parent);
+		return FS_ENOTDIR;
+	} // if
+	return parent;
+} // lookup_parent()
+
+// add a new entry to a directory, in FS_E terms
+static int add_to_dir(int dirInode, char *name, int inodeNum) {
+	int ret = dir_add_entry(dirInode, name, inodeNum);
+
+	if (ret == DIR_BAD_NAME)
+		return FS_ENAME;
+	if (ret == DIR_FULL)
+		return FS_EDIRFULL;
+	if (ret == DIR_CORRUPT)
+		return FS_EIO;
+	return ret;
+} // add_to_dir()
+
+/*
+ * Create a file holding size bytes, taken from data or, block by block,
+ * made by fill. With neither the file is one hole that reads as zeros and
+ * takes up no data blocks until written to. A file of at most INLINE_SIZE
+ * bytes keeps them in its inode instead. Returns its inode number. The
+ * new inode is not locked: nobody can find it before the parent directory
+ * is let go, which happens last.
+ */
+static int file_create(FsClient *c, char *path, int size, char *data, FsFill fill, void *arg) {
+	char leaf[MAX_FILE_NAME];
+	char tail[BLOCK_SIZE];
+	int i, ret;
+
+	// LARGE_FILE is unsigned, so the sign has to be checked first
 	if (size < 0)
-	{
-		printf("File create failed: cannot have negative size\n");
-		return -1;
-	}
-
-	int inodeNum = search_cur_dir(name);
+		return FS_EINVAL;
+	if (size > LARGE_FILE)
+		return FS_EFBIG;
+
+	// a file bigger than the disk fails for want of blocks before it logs them
+	int span = size_blocks(size) < MAX_BLOCK ? size_blocks(size) : MAX_BLOCK;
+	begin_op(c, TX_BLOCKS + ptr_blocks_needed(span));
+	int dirInode = lookup_parent(c->cwd, path, leaf);
+	if (dirInode < 0)
+		return end_op(dirInode);
+
+	int inodeNum = dir_lookup(dirInode, leaf);
 	if (inodeNum >= 0)
 	{
-		printf("File create failed:  %s exist.\n", name);
-		return -1;
+		iunlock(dirInode);
+		return end_op(FS_EEXIST);
 	}
 
-	if (curDir.numEntry + 1 > MAX_DIR_ENTRY)
+	int isInline = size <= INLINE_SIZE;
+	int numBlock = !isInline && (data != NULL || fill != NULL) ? size_blocks(size) : 0;
+
+	if (numBlock + ptr_blocks_needed(numBlock) > free_block_count())
 	{
-		printf("File create failed: directory is full!\n");
-		return -1;
+		iunlock(dirInode);
+		return end_op(FS_ENOSPC);
 	}
 
-	int numBlock = size / BLOCK_SIZE;
-	if (size % BLOCK_SIZE > 0)
-		numBlock++;
-
-	if (numBlock > superBlock.freeBlockCount)
+	// get inode and fill it
+	inodeNum = get_free_inode();
+	if (inodeNum < 0)
 	{
-		printf("File create failed: data block is full!\n");
-		return -1;
+		iunlock(dirInode);
+		return end_op(FS_ENOINODE);
 	}
 
-	if (superBlock.freeInodeCount < 1)
+	Inode *node = iget_dirty(inodeNum);
+	node->type = file;
+	node->owner = 1; // pre-defined
+	node->group = 2; // pre-defined
+	gettimeofday(&(node->created), NULL);
+	gettimeofday(&(node->lastAccess), NULL);
+	node->size = size;
+	node->blockCount = 0;
+	node->link_count = 1;
+	node->indirectBlock = 0;
+	node->doubleIndirectBlock = 0;
+	// a reused inode may still hold the block numbers of a directory
+	memset(node->directBlock, 0, sizeof(node->directBlock));
+	node->flags = isInline ? INODE_INLINE : 0;
+	if (isInline && fill != NULL)
+		fill(node->inlineData, 0, size, arg);
+	else if (isInline && data != NULL)
+		memcpy(node->inlineData, data, size);
+
+	// add a new file into its directory
+	if ((ret = add_to_dir(dirInode, leaf, inodeNum)) < 0)
 	{
-		printf("File create failed: inode is full!\n");
-		return -1;
+		set_free_inode(inodeNum);
+		iunlock(dirInode);
+		return end_op(ret);
 	}
 
-	char *tmp = (char *)malloc(sizeof(int) * size + 1);
-
-	rand_string(tmp, size);
-	printf("New File: %s\n", tmp);
-
-	// get inode and fill it
-	inodeNum = get_free_inode();
-	if (inodeNum < 0)
+	// get data blocks, consecutive where the free space allows it
+	int *blocks = (int *)malloc(sizeof(int) * (numBlock + 1));
+	if (get_free_blocks(blocks, numBlock) < 0)
 	{
-		printf("File_create error: not enough inode.\n");
-		return -1;
+		dir_remove_entry(dirInode, leaf);
+		set_free_inode(inodeNum);
+		free(blocks);
+		iunlock(dirInode);
+		return end_op(FS_ENOSPC);
 	}
-
-	inode[inodeNum].type = file;
-	inode[inodeNum].owner = 1; // pre-defined
-	inode[inodeNum].group = 2; // pre-defined
-	gettimeofday(&(inode[inodeNum].created), NULL);
-	gettimeofday(&(inode[inodeNum].lastAccess), NULL);
-	inode[inodeNum].size = size;
-	inode[inodeNum].blockCount = numBlock;
-	inode[inodeNum].link_count = 1;
-
-	// add a new file into the current directory entry
-	strncpy(curDir.dentry[curDir.numEntry].name, name, strlen(name));
-	curDir.dentry[curDir.numEntry].name[strlen(name)] = '\0';
-	curDir.dentry[curDir.numEntry].inode = inodeNum;
-	printf("curdir %s, name %s\n", curDir.dentry[curDir.numEntry].name, name);
-	curDir.numEntry++;
-
-	// get data blocks
 	for (i = 0; i < numBlock; i++)
 	{
-		int block = get_free_block();
-		if (block == -1)
-		{
-			printf("File_create error: get_free_block failed\n");
-			return -1;
+		char *src = tail;
+		int n = size - i * BLOCK_SIZE;
+
+		// whole blocks, so the tail of the last one is zeroed rather than read past
+		if (fill != NULL) {
+			if (n < BLOCK_SIZE)
+				memset(tail + n, 0, BLOCK_SIZE - n);
+			fill(tail, i * BLOCK_SIZE, n < BLOCK_SIZE ? n : BLOCK_SIZE, arg);
+		} else if (n >= BLOCK_SIZE)
+			src = data + i * BLOCK_SIZE;
+		else {
+			memset(tail, 0, BLOCK_SIZE);
+			memcpy(tail, data + i * BLOCK_SIZE, n);
 		}
-		//set direct block
-		inode[inodeNum].directBlock[i] = block;
-
-		disk_write(block, tmp + (i * BLOCK_SIZE));
+		bmap_set(node, i, blocks[i]);
+		journal_write_data(blocks[i], src);
 	}
+	node->blockCount = numBlock;
 
-	//update last access of current directory
-	gettimeofday(&(inode[curDir.dentry[0].inode].lastAccess), NULL);
-
-	printf("file created: %s, inode %d, size %d\n", name, inodeNum, size);
+	//update last access of the parent directory
+	gettimeofday(&(iget_dirty(dirInode)->lastAccess), NULL);
 
-	free(tmp);
-	return 0;
+	free(blocks);
+	iunlock(dirInode);
+	return end_op(inodeNum);
 } // file_create()
 
-int file_cat(char *name) {
-	int inodeNum, i, size;
-	char str_buffer[512];
-	char *str;
-
-	//get inode
-	inodeNum = search_cur_dir(name);
-	size = inode[inodeNum].size;
-
-	//check if valid input
-	if (inodeNum < 0) {
-		printf("cat error: file not found\n");
-		return -1;
-	}
-	if (inode[inodeNum].type == directory) {
-		printf("cat error: cannot read directory\n");
-		return -1;
-	}
-
-	//allocate str
-	str = (char *)malloc(sizeof(char) * (size + 1));
-	str[size] = '\0';
-
-	for (i = 0; i < inode[inodeNum].blockCount; i++) {
-		int block;
-		block = inode[inodeNum].directBlock[i];
+int fs_create(FsClient *c, char *path, int size, char *data) {
+	return file_create(c, path, size, data, NULL, NULL);
+} // fs_create()
+
+// fs_create() with the content made right in each block as it is written
+int fs_create_fill(FsClient *c, char *path, int size, FsFill fill, void *arg) {
+	return file_create(c, path, size, NULL, fill, arg);
+} // fs_create_fill()
+
+/*
+ * Copy bytes [offset, offset + size) of a file straight out of the block
+ * store, into buf or, when buf is NULL, to out. Only the blocks covering
+ * the range are touched, and each run of consecutive blocks that is
+ * contiguous in memory is copied at once. Holes read as zeros.
+ */
+static void read_range(Inode *node, int offset, int size, char *buf, FILE *out) {
+	static const char zero[BLOCK_SIZE];
+	int i = offset / BLOCK_SIZE;
+	int skip = offset % BLOCK_SIZE;
+
+	// no block to read at all
+	if (node->flags & INODE_INLINE) {
+		if (buf != NULL)
+			memcpy(buf, node->inlineData + offset, size);
+		else
+			fwrite(node->inlineData + offset, 1, size, out);
+		return;
+	} // if
 
-		disk_read(block, str_buffer);
+	while (size > 0) {
+		int want = (skip + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		int run, n;
+		int block = bmap(node, i);
+		for (run = 1; run < want; run++) {
+			int next = bmap(node, i + run);
+			if (block == 0 ? next != 0 : next != block + run)
+				break;
+		}
 
-		if (size >= BLOCK_SIZE) {
-			memcpy(str + i * BLOCK_SIZE, str_buffer, BLOCK_SIZE);
-			size -= BLOCK_SIZE;
+		if (block == 0) {
+			n = run * BLOCK_SIZE - skip;
+			if (n > size)
+				n = size;
+			if (buf != NULL) {
+				memset(buf, 0, n);
+				buf += n;
+			} else {
+				int left;
+				for (left = n; left > 0; left -= BLOCK_SIZE)
+					fwrite(zero, 1, left < BLOCK_SIZE ? left : BLOCK_SIZE, out);
+			}
 		} else {
-			memcpy(str + i * BLOCK_SIZE, str_buffer, size);
+			char *data = disk_peek(block, &run);
+			if (data == NULL)
+				break;
+
+			n = run * BLOCK_SIZE - skip;
+			if (n > size)
+				n = size;
+			if (buf != NULL) {
+				memcpy(buf, data + skip, n);
+				buf += n;
+			} else
+				fwrite(data + skip, 1, n, out);
+			disk_peek_done();
 		}
-	}
-	printf("%s\n", str);
-
-	//update lastAccess
-	gettimeofday(&(inode[inodeNum].lastAccess), NULL);
 
-	free(str);
-
-	//return success
-	return 0;
-} // file_cat()
+		size -= n;
+		i += run;
+		skip = 0;
+	}
+} // read_range()
 
 /**************************************************************************************************
 * This function will read the specified file name's content starting at the offset and reading 
-* the size amount. 
+* the size amount, into buf or to out. Returns the number of bytes read.
 **************************************************************************************************/
-int file_read(char *name, int offset, int size) {
+static int file_read(FsClient *c, char *path, int offset, int size, char *buf, FILE *out) {
 
 	/*
 	* PSEUDOCODE STEPS:
 	* 1) Read i-node
-	* 2) Read data
+	* 2) Read data from the blocks covering [offset, offset + size)
 	* 3) Write i-node (time of access)
 	*/
 
-	// function variables 
-	int i;
-	char str_buffer[512];
-	char *str;
+	fs_bind(c->image);
 
-	// get the i-node number of the file 
-	int inodeNum = search_cur_dir(name);
+	// get the i-node number of the file, locked shared so other readers go on
+	int inodeNum = lookup_path(c->cwd, path, 0);
 	// if the i node is valie (the file exists)
-	if (inodeNum < 0) {
-		printf("File read failed: %s does not exist.\n", name);
-		return -1;
-	} // if 
+	if (inodeNum < 0)
+		return inodeNum;
 
+	Inode *node = iget(inodeNum);
+	int ret = size;
 	// if the file is a directory 
-	if (inode[inodeNum].type == directory) {
-		printf("File read failed: %s is a directory.\n", name);
-		return -1;
-	} // if 
-
+	if (node->type == directory)
+		ret = FS_EISDIR;
+	// if the offset or size is negative
+	else if (offset < 0 || size < 0)
+		ret = FS_EINVAL;
 	// if the size is invalid 
-	if (inode[inodeNum].size < size || inode[inodeNum].size - offset < size) {
-		printf("File read failed: \'%s\' size of read request is too large.\n", name);
-		return -1;
+	else if (node->size < size || node->size - offset < size)
+		ret = FS_ERANGE;
+	else {
+		read_range(node, offset, size, buf, out);
+		// the access time goes out with the next transaction
+		touch_atime(inodeNum);
+	} // if-else
+
+	iunlock(inodeNum);
+	return ret;
+} // file_read()
+
+int fs_read(FsClient *c, char *path, int offset, int size, char *buf) {
+	return file_read(c, path, offset, size, buf, NULL);
+} // fs_read()
+
+// fs_read() to a stream, without copying the data through a buffer
+int fs_read_to(FsClient *c, char *path, int offset, int size, FILE *out) {
+	return file_read(c, path, offset, size, NULL, out);
+} // fs_read_to()
+
+/*
+ * Write size bytes of data into a file at offset, or at its end when
+ * append is set. Only the blocks the range covers are touched: whole
+ * ones are overwritten, partial ones read and patched, and holes in the
+ * range, past the old end included, get new blocks zero-filled where
+ * data does not cover them. A gap between the old end and offset stays
+ * a hole. A block shared with a clone is copied to a new block of the
+ * file's own first. Returns the number of bytes written.
+ */
+static int file_write(FsClient *c, char *path, int offset, int append, int size, char *data) {
+	char buf[BLOCK_SIZE];
+	int i, ret = size;
+
+	if (size < 0 || (!append && offset < 0))
+		return FS_EINVAL;
+
+	begin_op(c, file_tx_blocks(size_blocks(size) + 1));
+	int inodeNum = lookup_path(c->cwd, path, 1);
+	if (inodeNum < 0)
+		return end_op(inodeNum);
+
+	Inode *node = iget(inodeNum);
+	if (append)
+		offset = node->size;
+	// LARGE_FILE is unsigned, so the sum is checked without it overflowing
+	if (node->type == directory)
+		ret = FS_EISDIR;
+	else if (offset > (int)LARGE_FILE - size)
+		ret = FS_EFBIG;
+	if (ret < 0 || size == 0) {
+		iunlock(inodeNum);
+		return end_op(ret);
 	} // if
 
-	// allocate str to read the disk content into.
-	str = (char *)malloc(sizeof(char) * (size + 1));
-	str[size] = '\0';
-	int block_count = inode[inodeNum].blockCount;
-
-	// loop over all the blocks in the file and read the contents 
-	for (i = 0; i < block_count; i++) {
-		// get the current block at i
-		int block = inode[inodeNum].directBlock[i];
-		// read the contents from the disk into the buffer.
-		disk_read(block, str_buffer);
-		// if the size is larger than the block size, 
-		// copy the string from the memory location
-		// ... else just copy from the current block's memory location
-		if (size >= BLOCK_SIZE) {
-			memcpy(str + i * BLOCK_SIZE, str_buffer + offset, BLOCK_SIZE);
-			size -= BLOCK_SIZE;
-		} else {
-			memcpy(str + i * BLOCK_SIZE, str_buffer + offset, size);
-		} // if 
-	} // for 
-
-	// print the contents of the file 
-	printf("%s\n", str);
-
-	//update lastAccess
-	gettimeofday(&(inode[inodeNum].lastAccess), NULL);
+	int end = offset + size;
+	if (node->flags & INODE_INLINE) {
+		// the bytes past the old size are zero, so a gap needs nothing
+		if (end <= INLINE_SIZE) {
+			node = iget_dirty(inodeNum);
+			memcpy(node->inlineData + offset, data, size);
+			if (end > node->size)
+				node->size = end;
+			gettimeofday(&(node->lastAccess), NULL);
+			iunlock(inodeNum);
+			return end_op(ret);
+		} // if
+		// a block holds the same content, should the write fail below
+		if (uninline(iget_dirty(inodeNum)) < 0) {
+			iunlock(inodeNum);
+			return end_op(FS_ENOSPC);
+		} // if
+	} // if
+	int first = offset / BLOCK_SIZE, last = size_blocks(end);
+	int holes = 0, copies = 0, spare, h, k;
 
-	// deallocate the str buffer 
-	free(str);
+	/*
+	 * The holes the range covers, and the blocks in it another file shares,
+	 * get their new blocks together, as one extent. Blocks can stop being
+	 * shared meanwhile but not start, as that takes this file's lock.
+	 */
+	int *at = (int *)malloc(sizeof(int) * 2 * (last - first));
+	int *blocks = at + (last - first);
+	for (i = first; i < last; i++) {
+		int block = bmap(node, i);
+		if (block == 0)
+			at[holes++] = i;
+		else if (block_shared(block))
+			copies++;
+	} // for
+	// take every block needed up front, so a full disk changes nothing
+	if (holes + copies + ptr_blocks_missing(node, first, last) > free_block_count()
+			|| (holes + copies > 0 && get_free_blocks(blocks, holes + copies) < 0)) {
+		free(at);
+		iunlock(inodeNum);
+		return end_op(FS_ENOSPC);
+	} // if
+	node = iget_dirty(inodeNum);
+	for (k = 0; k < holes; k++) {
+		if (bmap_set(node, at[k], blocks[k]) < 0)
+			break;
+	} // for
+	if (k < holes) {
+		// out of pointer blocks after all; the holes stay holes
+		while (k > 0)
+			bmap_set(node, at[--k], 0);
+		for (k = 0; k < holes + copies; k++)
+			set_free_block(blocks[k]);
+		free(at);
+		iunlock(inodeNum);
+		return end_op(FS_ENOSPC);
+	} // if
+	node->blockCount += holes;
+
+	for (i = first, h = 0, spare = holes; i < last; i++) {
+		int from = i * BLOCK_SIZE > offset ? i * BLOCK_SIZE : offset;
+		int to = (i + 1) * BLOCK_SIZE < end ? (i + 1) * BLOCK_SIZE : end;
+		int block = bmap(node, i);
+		int fresh = h < holes && at[h] == i;
+		char *src = buf;
+
+		if (fresh)
+			h++;
+		if (to - from == BLOCK_SIZE)
+			src = data + (from - offset);
+		else {
+			// a block that was a hole starts out zeroed, and so does the tail of the last one
+			if (fresh)
+				memset(buf, 0, BLOCK_SIZE);
+			else
+				disk_read(block, buf);
+			memcpy(buf + from % BLOCK_SIZE, data + (from - offset), to - from);
+		} // if-else
+		// copy on write: the old content is read, so the share can go
+		if (!fresh && unshare_block(block)) {
+			block = blocks[spare++];
+			bmap_set(node, i, block);
+		} // if
+		journal_write_data(block, src);
+	} // for
+	// blocks the other owners let go of meanwhile were written in place
+	while (spare < holes + copies)
+		set_free_block(blocks[spare++]);
+	free(at);
+
+	if (end > node->size)
+		node->size = end;
+	gettimeofday(&(node->lastAccess), NULL);
+
+	iunlock(inodeNum);
+	return end_op(ret);
+} // file_write()
+
+int fs_write(FsClient *c, char *path, int offset, int size, char *data) {
+	return file_write(c, path, offset, 0, size, data);
+} // fs_write()
+
+// fs_write() at the end of the file, found under the file's lock
+int fs_append(FsClient *c, char *path, int size, char *data) {
+	return file_write(c, path, 0, 1, size, data);
+} // fs_append()
+
+/*
+ * Set the size of a file. Growing it adds a hole; shrinking it frees the
+ * blocks past the new end and zeroes the tail of the last one, so a later
+ * write or truncate past it reads zeros there.
+ */
+int fs_truncate(FsClient *c, char *path, int size) {
+	char buf[BLOCK_SIZE];
+
+	// LARGE_FILE is unsigned, so the sign has to be checked first
+	if (size < 0)
+		return FS_EINVAL;
+	if (size > LARGE_FILE)
+		return FS_EFBIG;
 
-	//return success
-	return 0;
-	
-} // file_read
+	begin_op(c, TX_BLOCKS + 3 + REF_BLOCKS);
+	int inodeNum = lookup_path(c->cwd, path, 1);
+	if (inodeNum < 0)
+		return end_op(inodeNum);
+	if (iget(inodeNum)->type == directory) {
+		iunlock(inodeNum);
+		return end_op(FS_EISDIR);
+	} // if
 
-int file_stat(char *name) {
-	char timebuf[28];
-	int inodeNum = search_cur_dir(name);
-	if (inodeNum < 0) {
-		printf("file cat error: file does not exist.\n");
-		return -1;
+	Inode *node = iget_dirty(inodeNum);
+	if (node->flags & INODE_INLINE) {
+		if (size < node->size)
+			memset(node->inlineData + size, 0, node->size - size);
+		else if (size > INLINE_SIZE && uninline(node) < 0) {
+			iunlock(inodeNum);
+			return end_op(FS_ENOSPC);
+		} // if-else
+	} else if (size < node->size) {
+		// zeroing the tail of a shared block takes a copy of it
+		int block = size % BLOCK_SIZE > 0 ? bmap(node, size / BLOCK_SIZE) : 0;
+		int spare = 0;
+		if (block > 0 && block_shared(block) && (spare = get_free_block()) < 0) {
+			iunlock(inodeNum);
+			return end_op(FS_ENOSPC);
+		} // if
+		truncate_blocks(node, size_blocks(size));
+		if (block > 0) {
+			disk_read(block, buf);
+			memset(buf + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+			if (spare > 0 && unshare_block(block)) {
+				block = spare;
+				bmap_set(node, size / BLOCK_SIZE, block);
+			} else if (spare > 0)
+				set_free_block(spare);
+			journal_write_data(block, buf);
+		} // if
 	} // if
+	node->size = size;
+	gettimeofday(&(node->lastAccess), NULL);
+
+	iunlock(inodeNum);
+	return end_op(0);
+} // fs_truncate()
+
+static void fill_stat(int inodeNum, FsStat *st) {
+	Inode *node = iget(inodeNum);
+
+	st->inode = inodeNum;
+	st->type = node->type;
+	st->owner = node->owner;
+	st->group = node->group;
+	st->size = node->size;
+	st->blockCount = node->blockCount;
+	st->linkCount = node->link_count;
+	st->created = node->created;
+	// readers holding the shared lock may be setting it, see touch_atime()
+	st->lastAccess.tv_sec = __atomic_load_n(&node->lastAccess.tv_sec, __ATOMIC_RELAXED);
+	st->lastAccess.tv_usec = __atomic_load_n(&node->lastAccess.tv_usec, __ATOMIC_RELAXED);
+} // fill_stat()
+
+int fs_stat(FsClient *c, char *path, FsStat *st) {
+	fs_bind(c->image);
+	int inodeNum = lookup_path(c->cwd, path, 0);
+	if (inodeNum < 0)
+		return inodeNum;
 
-	printf("Inode\t\t= %d\n", inodeNum);
-	if (inode[inodeNum].type == file)
-		printf("type\t\t= File\n");
-	else
-		printf("type\t\t= Directory\n");
-	printf("owner\t\t= %d\n", inode[inodeNum].owner);
-	printf("group\t\t= %d\n", inode[inodeNum].group);
-	printf("size\t\t= %d\n", inode[inodeNum].size);
-	printf("link_count\t= %d\n", inode[inodeNum].link_count);
-	printf("num of block\t= %d\n", inode[inodeNum].blockCount);
-	format_timeval(&(inode[inodeNum].created), timebuf, 28);
-	printf("Created time\t= %s\n", timebuf);
-	format_timeval(&(inode[inodeNum].lastAccess), timebuf, 28);
-	printf("Last acc. time\t= %s\n", timebuf);
-} // file_stat()
+	fill_stat(inodeNum, st);
+	iunlock(inodeNum);
+	return 0;
+} // fs_stat()
 
 /**************************************************************************************************
-* NEED TO IMPLEMENT!!
 * This function will remove the file by name.
 **************************************************************************************************/
-int file_remove(char *name) {
+int fs_unlink(FsClient *c, char *path) {
 	/* 
 	 * PSUEDOCODE STEPS:
 	 * 1) Check that file exists
@@ -389,271 +1296,262 @@ int file_remove(char *name) {
 	 * 		3.b) reduce the link count of the i-node
 	*/
 
+	begin_op(c, TX_BLOCKS + REF_BLOCKS);
+
 	// get the i-node number of the file 
-	int inodeNum = search_cur_dir(name);
+	char leaf[MAX_FILE_NAME];
+	int dirInode = lookup_parent(c->cwd, path, leaf);
+	if (dirInode < 0)
+		return end_op(dirInode == FS_ENOTDIR ? dirInode : FS_ENOENT);
+	int inodeNum = dir_lookup(dirInode, leaf);
 	// if the i node is valie (the file exists)
 	if (inodeNum < 0) {
-		printf("File removal failed: %s does not exist.\n", name);
-		return -1;
+		iunlock(dirInode);
+		return end_op(FS_ENOENT);
 	} // if 
 
-	// if the file is a directory 
-	if (inode[inodeNum].type == directory) {
-		printf("File removal failed: %s is a directory.\n", name);
-		return -1;
+	// if the file is a directory ("." and ".." included, which are never locked here)
+	if (iget(inodeNum)->type == directory) {
+		iunlock(dirInode);
+		return end_op(FS_EISDIR);
 	} // if 
 
-	// if the file has no links
-	// else if the file has one or more links 
-	if (inode[inodeNum].link_count == 1) {
-		// File has no links
-
-		// remove from directory
-		remove_from_dir(name); 
+	// wait for readers of the file to finish
+	ilock_write(inodeNum);
 
-		// clear up inode bitmap
-		set_free_inode(inodeNum); 
-
-		// clear up data block bitmap
-		for (int i = 0; i < inode[inodeNum].blockCount; i++) {
-			set_free_block(inode[inodeNum].directBlock[i]); // need to loop this probably
-		} // for
-
-		printf("%s has been successfully removed\n", name); 
+	// remove from directory
+	dir_remove_entry(dirInode, leaf); 
 
-		return 0;
-	} else if (inode[inodeNum].link_count > 1) {
-		// File has at least one link 
+	// if the file has no other links
+	// else if the file has one or more links 
+	if (iget(inodeNum)->link_count <= 1) {
+		// a link racing with this sees the count gone, see fs_link()
+		iget_dirty(inodeNum)->link_count = 0;
 
-		// remove from directory
-		remove_from_dir(name); 
+		// clear up data block bitmap, pointer blocks included
+		free_file_blocks(iget_dirty(inodeNum));
 
+		// clear up inode bitmap last: a create may reuse the inode at once
+		set_free_inode(inodeNum); 
+	} else {
 		// decrease the link count
-		inode[inodeNum].link_count--;
-
-		printf("%s has been successfully removed\n", name); 
-		return 0;
+		iget_dirty(inodeNum)->link_count--;
 	} // if-else 
 
-	// will only happen if something went wrong
-	printf("Error! %s has not been removed\n", name); 
-	return -1;
-}
+	iunlock(inodeNum);
+	iunlock(dirInode);
+	return end_op(0);
+} // fs_unlink()
 
 /**************************************************************************************************
-* BONUS POINTS 
 * Create a directory 
 **************************************************************************************************/
-int dir_make(char *name) {
+int fs_mkdir(FsClient *c, char *path) {
+	int ret;
 
-	// check if the name is already in the directory
-	int inodeNum = search_cur_dir(name);
-	if (inodeNum >= 0) {
-		printf("Directory make failed: \'/%s\' exist.\n", name);
-		return -1;
-	} // if 
+	begin_op(c, TX_BLOCKS);
 
-	// check if there is space in the directory
-	if (curDir.numEntry + 1 > MAX_DIR_ENTRY) {
-		printf("Directory make failed: directory is full!\n");
-		return -1;
-	} // if 
+	// find the parent directory
+	char leaf[MAX_FILE_NAME];
+	int parentInode = lookup_parent(c->cwd, path, leaf);
+	if (parentInode < 0)
+		return end_op(parentInode);
 
-	// check if the inode count is full
-	if (superBlock.freeInodeCount < 1) {
-		printf("Directory make failed: inode is full!\n");
-		return -1;
-	} // if 
+	// check if the name is already in the directory
+	if (dir_lookup(parentInode, leaf) >= 0) {
+		iunlock(parentInode);
+		return end_op(FS_EEXIST);
+	} // if
 
 	// check if the block count is full 
 	int numBlock = 1;
-	if (numBlock > superBlock.freeBlockCount) {
-		printf("Directory make failed: data block is full!\n");
-		return -1;
+	if (numBlock > free_block_count()) {
+		iunlock(parentInode);
+		return end_op(FS_ENOSPC);
 	} // if
 
 	// get a free inode
 	int dirInode = get_free_inode();
 	if (dirInode < 0) {
-		printf("Directory make error: not enough inode.\n");
-		return -1;
+		iunlock(parentInode);
+		return end_op(FS_ENOINODE);
 	} // if 
 
-	// Init root dir
-	int dirBlock = get_free_block();
-	if (dirBlock < 0) {
-		printf("Directory make error: not enough free blocks.\n");
-		return -1;
+	// create the new directory's block with its "." and ".." entries
+	if (dir_init(dirInode, parentInode) < 0) {
+		set_free_inode(dirInode);
+		iunlock(parentInode);
+		return end_op(FS_ENOSPC);
 	} // if
 
-	// Set the inode info for the new directory
-	inode[dirInode].type = directory;
-	inode[dirInode].owner = 1;
-	inode[dirInode].group = 2;
-	gettimeofday(&(inode[dirInode].created), NULL);
-	gettimeofday(&(inode[dirInode].lastAccess), NULL);
-	inode[dirInode].size = 1;
-	inode[dirInode].blockCount = 1;
-	inode[dirInode].directBlock[0] = dirBlock;
-
-	// add a new directory into the current directory entry
-	strncpy(curDir.dentry[curDir.numEntry].name, name, strlen(name));
-	curDir.dentry[curDir.numEntry].name[strlen(name)] = '\0';
-	curDir.dentry[curDir.numEntry].inode = dirInode;
-	// printf("curdir %s, name %s\n", curDir.dentry[curDir.numEntry].name, name);
-	curDir.numEntry++;
-
-	Dentry newDir;	// create a new direcotry entry 
-
-	// create the current dir "." entry and store the relevant info
-	newDir.numEntry = 2;
-	strncpy(newDir.dentry[0].name, ".", 1);
-	newDir.dentry[0].name[1] = '\0';
-	newDir.dentry[0].inode = dirInode;
-	// disk_write(dirBlock, (char *)&newDir);
-
-	// create the parent dir ".." entry and store the relevant info
-	strncpy(newDir.dentry[1].name, "..", 2);
-	newDir.dentry[1].name[3] = '\0';
-	newDir.dentry[1].inode = curDir.dentry[0].inode;
-	// disk_write(dirBlock, (char *)&curDir);
-
-	// write the new Direcotry entry struct it to the new block
-	disk_write(dirBlock, (char *)&newDir);
-
-	// Print a message to the user that the creation was a success 	
-	printf("Directory \'/%s\' created successfully\n", name);
+	// add a new directory into its parent
+	if ((ret = add_to_dir(parentInode, leaf, dirInode)) < 0) {
+		dir_release(dirInode);
+		set_free_inode(dirInode);
+		iunlock(parentInode);
+		return end_op(ret);
+	} // if
 
-	return 0;
-} // dir_make()
+	// Set the inode info for the new directory
+	Inode *node = iget_dirty(dirInode);
+	node->type = directory;
+	node->flags = 0;
+	node->owner = 1;
+	node->group = 2;
+	gettimeofday(&(node->created), NULL);
+	gettimeofday(&(node->lastAccess), NULL);
+	node->size = 1;
+
+	iunlock(parentInode);
+	return end_op(0);
+} // fs_mkdir()
+
+// whether some client has inodeNum as its current directory
+static int is_cwd(int inodeNum) {
+	FsClient *other;
+	int found = 0;
+
+	pthread_mutex_lock(&fs->clientLock);
+	for (other = fs->clients; other != NULL; other = other->next) {
+		if (other->cwd == inodeNum)
+			found = 1;
+	} // for
+	pthread_mutex_unlock(&fs->clientLock);
+	return found;
+} // is_cwd()
 
 /**************************************************************************************************
-* BONUS POINTS 
-* Remove a directory 
+* Remove an empty directory 
 **************************************************************************************************/
-int dir_remove(char *name) {
-
-	/* 
-	 * PSUEDOCODE STEPS:
-	 * 1) Check that dircetory exists and is not a file 
-	 * 2) if there are directories inside dir, make recursive call to dir_remove()
-	 * 		2.a) remove from the current directory list
-	 * 		2.b) Free i-node entry
-	 * 		2.c) Free data blocks
-	 * 3) If there are Files in the directory, remove them all
-	 * 
-	*/
+int fs_rmdir(FsClient *c, char *path) {
+	int ret = 0;
 
-	// check if the name is already in the directory
-	int inodeNum = search_cur_dir(name);
-	if (inodeNum < 0) {
-		printf("Directory remove failed: \'/%s\' does not exist.\n", name);
-		return -1;
-	} // if 
+	begin_op(c, TX_BLOCKS);
 
+	// check if the name is in the directory
+	char leaf[MAX_FILE_NAME];
+	int parentInode = lookup_parent(c->cwd, path, leaf);
+	if (parentInode < 0)
+		return end_op(parentInode == FS_ENOTDIR ? parentInode : FS_ENOENT);
+	int inodeNum = dir_lookup(parentInode, leaf);
+	if (inodeNum < 0)
+		ret = FS_ENOENT;
 	// if the dir is a file 
-	if (inode[inodeNum].type == file) {
-		printf("Directory removal failed: \'/%s\' is a file.\n", name);
-		return -1;
-	} // if 
-
-	Dentry dirToBeDeleted; // the reference for the file structure to be deleted 
-
-	// get the block number of the directory to switch to 
-	int dirBlocktoBeDeleted = inode[inodeNum].directBlock[0];
-	// load the dest dir's entry table into memory
-	disk_read(dirBlocktoBeDeleted, (char *)&dirToBeDeleted);
-
-	// if trying to delete the current directory 
-	if (dirToBeDeleted.dentry[0].inode == curDir.dentry[0].inode) {
-		printf("Directory removal failed: \'/%s\' is the current Directory.\n", name);
-		return -1;
-	} // if 
-
-	// if trying to delete a parent directory
-	if (dirToBeDeleted.dentry[0].inode == curDir.dentry[1].inode) { 
-		printf("Directory removal failed: \'/%s\' is the current Directory's parent.\n", name);
-		return -1;
+	else if (iget(inodeNum)->type == file)
+		ret = FS_ENOTDIR;
+	// "." and ".." are not names that can be unlinked
+	else if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0)
+		ret = FS_EINVAL;
+	if (ret < 0) {
+		iunlock(parentInode);
+		return end_op(ret);
 	} // if
 
+	ilock_write(inodeNum);
+	// if some client is in the directory; its parents are never empty
+	if (is_cwd(inodeNum))
+		ret = FS_EBUSY;
 	// if the Directory is not empty 
-	if (dirToBeDeleted.numEntry > 2) {
-		printf("Failed to remove \'/%s\': Directory not empty!\n", name);
-		return -1;
-	} // if
-
-	// remove from directory
-	remove_from_dir(name); 
-
-	// clear up inode bitmap
-	set_free_inode(inodeNum); 
+	else if (dir_num_entries(inodeNum) > 2)
+		ret = FS_ENOTEMPTY;
+	else {
+		// remove from directory
+		dir_remove_entry(parentInode, leaf); 
 
-	// clear up data block bitmap
-	for (int i = 0; i < inode[inodeNum].blockCount; i++) {
-		set_free_block(inode[inodeNum].directBlock[i]); // need to loop this probably
-	} // for
+		// clear up data block bitmap, index blocks included
+		dir_release(inodeNum);
 
+		// clear up inode bitmap last: a mkdir may reuse the inode at once
+		set_free_inode(inodeNum); 
+	} // if-else
 
-	printf("%s has been successfully removed\n", name); 
-	return 0;
-} // dir_remove()
+	iunlock(inodeNum);
+	iunlock(parentInode);
+	return end_op(ret);
+} // fs_rmdir()
 
 /**************************************************************************************************
-* BONUS POINTS 
 * Change direcotries
 **************************************************************************************************/
-int dir_change(char *name) {
-	// check if the name is already in the directory
-	int inodeNum = search_cur_dir(name);
-	if (inodeNum < 0) {
-		printf("cd failed: \'/%s\' does not exist.\n", name);
-		return -1;
-	} // if 
+int fs_chdir(FsClient *c, char *path) {
+	fs_bind(c->image);
+
+	// check if the name is in the directory
+	int inodeNum = lookup_path(c->cwd, path, 0);
+	if (inodeNum < 0)
+		return inodeNum;
 
 	// check if the type is a file 
-	if (inode[inodeNum].type == file) {
-		printf("cd error: \'%s\' is a file\n", name);
-		return -1;
+	if (iget(inodeNum)->type == file) {
+		iunlock(inodeNum);
+		return FS_ENOTDIR;
 	} // if
 
-	// write current Directory changes to block before switching 
-	disk_write(curDirBlock, (char *)&curDir);
-
-	// get the block number of the directory to switch to 
-	curDirBlock = inode[inodeNum].directBlock[0];
-	// load the dest dir's entry table into memory
-	disk_read(curDirBlock, (char *)&curDir);
-
-	// Print a message to the user that the change was a success 	
-	printf("Current directory: \'/%s\'\n", name); 
-
+	// directory changes are already in their blocks, just switch; the lock
+	// keeps fs_rmdir() from missing the new current directory
+	pthread_mutex_lock(&fs->clientLock);
+	c->cwd = inodeNum;
+	pthread_mutex_unlock(&fs->clientLock);
+	iunlock(inodeNum);
 	return 0;
-} // dir_change()
-
-int ls() {
-	int i;
-	for (i = 0; i < curDir.numEntry; i++) {
-		int n = curDir.dentry[i].inode;
-		if (inode[n].type == file)
-			printf("type: file, ");
-		else
-			printf("type: dir, ");
-		printf("name \"%s\", inode %d, size %d byte\n", curDir.dentry[i].name, curDir.dentry[i].inode, inode[n].size);
+} // fs_chdir()
+
+typedef struct {
+	int count;
+	int size;
+	struct {
+		char name[MAX_FILE_NAME];
+		int inode;
+	} *entry;
+} DirList;
+
+static void list_entry(char *name, int n, void *arg) {
+	DirList *list = (DirList *)arg;
+
+	if (list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 64;
+		list->entry = realloc(list->entry, sizeof(list->entry[0]) * list->size);
+	} // if
+	strcpy(list->entry[list->count].name, name);
+	list->entry[list->count++].inode = n;
+} // list_entry()
+
+/*
+ * Call visit for every entry of a directory, the current one if path is
+ * NULL. The names are collected first and the directory let go, then
+ * each entry is locked on its own to be looked at, so this takes no lock
+ * against the order (".." is a parent) and visit may take its time.
+ */
+int fs_readdir(FsClient *c, char *path, FsDirVisitor visit, void *arg) {
+	DirList list = {0, 0, NULL};
+	FsStat st;
+	int inodeNum, i;
+
+	fs_bind(c->image);
+	inodeNum = lookup_path(c->cwd, path != NULL ? path : ".", 0);
+	if (inodeNum < 0)
+		return inodeNum;
+	if (iget(inodeNum)->type == file) {
+		iunlock(inodeNum);
+		return FS_ENOTDIR;
+	} // if
+	dir_foreach(inodeNum, list_entry, &list);
+	iunlock(inodeNum);
+
+	for (i = 0; i < list.count; i++) {
+		ilock_read(list.entry[i].inode);
+		fill_stat(list.entry[i].inode, &st);
+		iunlock(list.entry[i].inode);
+		visit(list.entry[i].name, &st, arg);
 	} // for
-
+	free(list.entry);
 	return 0;
-} // ls()
-
-int fs_stat() {
-	printf("File System Status: \n");
-	printf("# of free blocks: %d (%d bytes), # of free inodes: %d\n", superBlock.freeBlockCount, superBlock.freeBlockCount * 512, superBlock.freeInodeCount);
-} // fs_stat()
+} // fs_readdir()
 
 /**************************************************************************************************
-* NEED TO IMPLEMENT!!
 * This function will make a hard link of another file.
 **************************************************************************************************/
-int hard_link(char *src, char *dest) {
+int fs_link(FsClient *c, char *src, char *dest) {
 	/* 
 	 * PSUEDOCODE STEPS: 
 	 * 1) Check if src exists and is not directory 
@@ -662,168 +1560,216 @@ int hard_link(char *src, char *dest) {
 	 * 4) make dest point to data 
 	 * 5) increase link counter 
 	*/ 
+	int ret = 0;
+
+	begin_op(c, TX_BLOCKS);
 
 	// get the i-node number of the src file 
-	int srcInodeNum = search_cur_dir(src);
+	int srcInodeNum = lookup_path(c->cwd, src, 0);
 	// if the i node is valid (the file exists)
-	if (srcInodeNum < 0) {
-		printf("Hard Link failed: %s does not exist.\n", src);
-		return -1;
-	} // if 
+	if (srcInodeNum < 0)
+		return end_op(srcInodeNum);
 
 	// if the src file is a directory 
-	if (inode[srcInodeNum].type == directory) {
-		printf("Hard Link failed: %s is a directory.\n", src);
-		return -1;
-	} // if 
-
-	// get the i-node of the dest file 
-	int destInodeNum = search_cur_dir(dest);
-	// if the desst file is valied (it exists)
-	if (destInodeNum >= 0) {
-		printf("Hard Link failed:  %s exist.\n", dest);
-		return -1;
+	int isDir = iget(srcInodeNum)->type == directory;
+	// a file is locked after directories, so let go of it for now
+	iunlock(srcInodeNum);
+	if (isDir)
+		return end_op(FS_EISDIR);
+
+	// get the directory and i-node of the dest file 
+	char leaf[MAX_FILE_NAME];
+	int dirInode = lookup_parent(c->cwd, dest, leaf);
+	if (dirInode < 0)
+		return end_op(dirInode);
+	// if the dest file is valid (it exists)
+	if (dir_lookup(dirInode, leaf) >= 0) {
+		iunlock(dirInode);
+		return end_op(FS_EEXIST);
 	} // if
 
-	// if the directory is full, do not add the new file 
-	if (curDir.numEntry + 1 > MAX_DIR_ENTRY) {
-		printf("Hard Link failed: directory is full!\n");
-		return -1;
-	} // if 
-
-	int srcSize = inode[srcInodeNum].size; // the size of the src file
-	int srcNumBlock = inode[srcInodeNum].blockCount; // the number of blocks of the src file
-	// if the the size does not fit in one block, increase the block count. 
-	if (srcSize % BLOCK_SIZE > 0)
-		srcNumBlock++;
-
-	// if the number of blokcs of the src 
-	if (srcNumBlock > superBlock.freeBlockCount) {
-		printf("Hard Link failed: data block is full!\n");
-		return -1;
-	} // if 
-
-	if (superBlock.freeInodeCount < 1) {
-		printf("Hard Link failed: inode is full!\n");
-		return -1;
-	} //if 
-
-	// update the last access time of the inode that now refers to both dest and src files 
-	gettimeofday(&(inode[srcInodeNum].lastAccess), NULL);
-
-	// update the link count of the src file 
-	inode[srcInodeNum].link_count++;
-
-	// add a new file into the current directory entry
-	strncpy(curDir.dentry[curDir.numEntry].name, dest, strlen(dest));
-	curDir.dentry[curDir.numEntry].name[strlen(dest)] = '\0';
-	curDir.dentry[curDir.numEntry].inode = srcInodeNum;
-	// printf("curdir %s, name %s\n", curDir.dentry[curDir.numEntry].name, dest);
-	curDir.numEntry++;
-
-	//update last access of current directory
-	gettimeofday(&(inode[curDir.dentry[0].inode].lastAccess), NULL);
-
-	printf("link created: %s --> %d\n", dest, src);
+	/*
+	 * The source may have been removed in between, which fs_unlink() leaves
+	 * as a link count of 0. If its inode was even handed to a new file in
+	 * that time, the link goes to that file: the same as linking right
+	 * after the new file was created under the old name.
+	 */
+	ilock_write(srcInodeNum);
+	Inode *node = iget(srcInodeNum);
+	if (node->type != file || node->link_count < 1)
+		ret = FS_ENOENT;
+	// add a new file into the dest directory
+	else if ((ret = add_to_dir(dirInode, leaf, srcInodeNum)) == 0) {
+		// update the last access time of the inode that now refers to both dest and src files 
+		gettimeofday(&(iget_dirty(srcInodeNum)->lastAccess), NULL);
+
+		// update the link count of the src file 
+		iget_dirty(srcInodeNum)->link_count++;
+
+		//update last access of the dest directory
+		gettimeofday(&(iget_dirty(dirInode)->lastAccess), NULL);
+	} // if-else
+
+	iunlock(srcInodeNum);
+	iunlock(dirInode);
+	return end_op(ret);
+} // fs_link()
+
+// a copy of pointer block from in block, which stays out of the pointer cache until read
+static void copy_ptr_block(int from, int block) {
+	int ptr[PTRS_PER_BLOCK];
+
+	memcpy(ptr, read_ptr_block(from), BLOCK_SIZE);
+	forget_ptr_block(block);
+	journal_write(block, (char *)ptr);
+} // copy_ptr_block()
+
+/*
+ * Copy the pointer blocks of src for clone into the blocks given, as many
+ * as src has, so that the clone maps the same data blocks.
+ */
+static void clone_ptr_blocks(Inode *src, Inode *clone, int *blocks) {
+	int per = PTRS_PER_BLOCK;
+	int ptr[PTRS_PER_BLOCK];
+	int g;
+
+	if (src->indirectBlock) {
+		clone->indirectBlock = *blocks++;
+		copy_ptr_block(src->indirectBlock, clone->indirectBlock);
+	} // if
+	if (src->doubleIndirectBlock) {
+		clone->doubleIndirectBlock = *blocks++;
+		memcpy(ptr, read_ptr_block(src->doubleIndirectBlock), BLOCK_SIZE);
+		for (g = 0; g < per; g++) {
+			if (ptr[g] == 0)
+				continue;
+			copy_ptr_block(ptr[g], *blocks);
+			ptr[g] = *blocks++;
+		} // for
+		forget_ptr_block(clone->doubleIndirectBlock);
+		journal_write(clone->doubleIndirectBlock, (char *)ptr);
+	} // if
+} // clone_ptr_blocks()
+
+// pointer blocks a file has
+static int ptr_block_count(Inode *node) {
+	int per = PTRS_PER_BLOCK;
+	int n = node->indirectBlock != 0, g;
+
+	if (node->doubleIndirectBlock) {
+		int *ptr = read_ptr_block(node->doubleIndirectBlock);
+		n++;
+		for (g = 0; g < per; g++)
+			n += ptr[g] != 0;
+	} // if
+	return n;
+} // ptr_block_count()
+
+/*
+ * Make dest a clone of the file src: a new inode that maps the same data
+ * blocks, each of which gets one more owner. Only the inode and the
+ * pointer blocks are copied; a data block is copied when either file
+ * writes it, see file_write().
+ */
+int fs_reflink(FsClient *c, char *src, char *dest) {
+	char leaf[MAX_FILE_NAME];
+	int ret, i, n;
+
+	begin_op(c, TX_BLOCKS + ptr_blocks_needed(MAX_BLOCK) + REF_BLOCKS);
+	if (fs->superBlock.refStart == 0)
+		return end_op(FS_ENOSPC);
+
+	int srcInodeNum = lookup_path(c->cwd, src, 0);
+	if (srcInodeNum < 0)
+		return end_op(srcInodeNum);
+	int isDir = iget(srcInodeNum)->type == directory;
+	// a file is locked after directories, so let go of it for now
+	iunlock(srcInodeNum);
+	if (isDir)
+		return end_op(FS_EISDIR);
+
+	int dirInode = lookup_parent(c->cwd, dest, leaf);
+	if (dirInode < 0)
+		return end_op(dirInode);
+	if (dir_lookup(dirInode, leaf) >= 0) {
+		iunlock(dirInode);
+		return end_op(FS_EEXIST);
+	} // if
 
-	return 0;
-} // hard_link()
+	// the source may have gone in between, as in fs_link()
+	ilock_read(srcInodeNum);
+	Inode *node = iget(srcInodeNum);
+	if (node->type != file || node->link_count < 1) {
+		iunlock(srcInodeNum);
+		iunlock(dirInode);
+		return end_op(FS_ENOENT);
+	} // if
 
-int execute_command(char *comm, char *arg1, char *arg2, char *arg3, char *arg4, int numArg) {
+	// a sparse file may have more pointer blocks than the call reserved in the journal
+	int ptrs = node->flags & INODE_INLINE ? 0 : ptr_block_count(node);
+	if (ptrs > ptr_blocks_needed(MAX_BLOCK)) {
+		iunlock(srcInodeNum);
+		iunlock(dirInode);
+		return end_op(FS_EFBIG);
+	} // if
 
-	printf("\n");
-	if (command(comm, "df"))
-	{
-		return fs_stat();
+	int inodeNum = get_free_inode();
+	if (inodeNum < 0) {
+		iunlock(srcInodeNum);
+		iunlock(dirInode);
+		return end_op(FS_ENOINODE);
+	} // if
+	// every pointer block of the clone in one go, so a full disk changes nothing
+	int *blocks = (int *)malloc(sizeof(int) * (ptrs + 1));
+	if (ptrs > free_block_count() || (ptrs > 0 && get_free_blocks(blocks, ptrs) < 0)) {
+		set_free_inode(inodeNum);
+		free(blocks);
+		iunlock(srcInodeNum);
+		iunlock(dirInode);
+		return end_op(FS_ENOSPC);
+	} // if
 
-		// file command start
-	}
-	else if (command(comm, "create"))
-	{
-		if (numArg < 2)
-		{
-			printf("error: create <filename> <size>\n");
-			return -1;
-		}
-		return file_create(arg1, atoi(arg2)); // (filename, size)
-	}
-	else if (command(comm, "stat"))
-	{
-		if (numArg < 1)
-		{
-			printf("error: stat <filename>\n");
-			return -1;
-		}
-		return file_stat(arg1); //(filename)
-	}
-	else if (command(comm, "cat"))
-	{
-		if (numArg < 1)
-		{
-			printf("error: cat <filename>\n");
-			return -1;
-		}
-		return file_cat(arg1); // file_cat(filename)
-	}
-	else if (command(comm, "read"))
-	{
-		if (numArg < 3)
-		{
-			printf("error: read <filename> <offset> <size>\n");
-			return -1;
-		}
-		return file_read(arg1, atoi(arg2), atoi(arg3)); // file_read(filename, offset, size);
-	}
-	else if (command(comm, "rm"))
-	{
-		if (numArg < 1)
-		{
-			printf("error: rm <filename>\n");
-			return -1;
-		}
-		return file_remove(arg1); //(filename)
-	}
-	else if (command(comm, "ln"))
-	{
-		return hard_link(arg1, arg2); // hard link. arg1: src file or dir, arg2: destination file or dir
+	// one more owner for every data block
+	int span = node->flags & INODE_INLINE ? 0 : size_blocks(node->size);
+	for (n = 0, ret = 0; n < span; n++) {
+		int block = bmap(node, n);
+		if (block > 0 && share_block(block) < 0) {
+			ret = FS_EMLINK;
+			break;
+		} // if
+	} // for
+	if (ret == 0)
+		ret = add_to_dir(dirInode, leaf, inodeNum);
+	if (ret < 0) {
+		// give back the shares taken so far
+		while (n-- > 0) {
+			int block = bmap(node, n);
+			if (block > 0)
+				unshare_block(block);
+		} // while
+		for (i = 0; i < ptrs; i++)
+			set_free_block(blocks[i]);
+		set_free_inode(inodeNum);
+		free(blocks);
+		iunlock(srcInodeNum);
+		iunlock(dirInode);
+		return end_op(ret);
+	} // if
 
-		// directory command start
-	}
-	else if (command(comm, "ls"))
-	{
-		return ls();
-	}
-	else if (command(comm, "mkdir"))
-	{
-		if (numArg < 1)
-		{
-			printf("error: mkdir <dirname>\n");
-			return -1;
-		}
-		return dir_make(arg1); // (dirname)
-	}
-	else if (command(comm, "rmdir"))
-	{
-		if (numArg < 1)
-		{
-			printf("error: rmdir <dirname>\n");
-			return -1;
-		}
-		return dir_remove(arg1); // (dirname)
-	}
-	else if (command(comm, "cd"))
-	{
-		if (numArg < 1)
-		{
-			printf("error: cd <dirname>\n");
-			return -1;
-		}
-		return dir_change(arg1); // (dirname)
-	}
-	else
-	{
-		fprintf(stderr, "%s: command not found.\n", comm);
-		return -1;
-	}
-	return 0;
-} // execute_command()
\ No newline at end of file
+	Inode *clone = iget_dirty(inodeNum);
+	*clone = *node;
+	clone->link_count = 1;
+	clone->indirectBlock = 0;
+	clone->doubleIndirectBlock = 0;
+	gettimeofday(&(clone->created), NULL);
+	clone->lastAccess = clone->created;
+	clone_ptr_blocks(node, clone, blocks);
+	free(blocks);
+
+	//update last access of the dest directory
+	gettimeofday(&(iget_dirty(dirInode)->lastAccess), NULL);
+
+	iunlock(srcInodeNum);
+	iunlock(dirInode);
+	return end_op(inodeNum);
+} // fs_reflink()
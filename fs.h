@@ -1,11 +1,22 @@
+#ifndef FS_H
+#define FS_H
+
+#include <stdio.h>
 #include <sys/time.h>
 #include "disk.h"
 
 #define MAX_BLOCK 4096
 #define MAX_INODE 512
 #define MAX_FILE_NAME 20
+#define MAX_PATH 256
+#define ROOT_INODE 0
 #define SMALL_FILE 6144
-//#define LARGE_FILE 70656
+#define DIRECT_BLOCKS 12
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(int))
+#define MAX_FILE_BLOCKS (DIRECT_BLOCKS + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define LARGE_FILE (MAX_FILE_BLOCKS * BLOCK_SIZE)
+#define INLINE_SIZE (DIRECT_BLOCKS * 4) // the bytes of directBlock[]
+#define INODE_INLINE 0x01 // the data is in inlineData[], with no blocks
 #define MAGIC_NUMBER 0x1234FFFF
 #define MAX_DIR_ENTRY BLOCK_SIZE / sizeof(DirectoryEntry)
 
@@ -15,7 +26,12 @@ typedef struct {
 		int magicNumber;
 		int freeBlockCount;
 		int freeInodeCount;
-		char padding[500];
+		int journalStart; // first block of the journal, 0 if none
+		int journalBlocks;
+		int journalSeq; // oldest transaction group not yet checkpointed
+		int refStart; // first block of the block reference counts, 0 if none
+		int refBlocks;
+		char padding[480];
 } SuperBlock;
 
 typedef struct {
@@ -25,12 +41,22 @@ typedef struct {
 		struct timeval lastAccess;
 		struct timeval created;
 		int size;
-		int blockCount; // how many blocks the file takes up
-		int directBlock[12];
+		int blockCount; // how many data blocks the file takes up, holes not counted
+		union {
+				int directBlock[DIRECT_BLOCKS];
+				char inlineData[INLINE_SIZE]; // a file of at most INLINE_SIZE bytes, see INODE_INLINE
+		};
 		int link_count; // for hardlink
-		char padding[16];
+		int indirectBlock; // block of PTRS_PER_BLOCK more block numbers, 0 if none
+		int doubleIndirectBlock; // block of indirect block numbers, 0 if none
+		char flags; // INODE_ bits
+		char padding[7];
 } Inode; // 128 byte
 
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(Inode))
+#define INODE_START 3 // after the superblock and the two bitmaps
+#define INODE_BLOCKS (MAX_INODE / INODES_PER_BLOCK)
+
 typedef struct {
 		char name[MAX_FILE_NAME];
 		int inode;
@@ -42,10 +68,112 @@ typedef struct {
 		char padding[4];
 } Dentry;
 
-extern char inodeMap[MAX_INODE / 8];
-extern char blockMap[MAX_BLOCK / 8];
-extern SuperBlock superBlock;
+/*
+ * Library interface. A FileSystem is one open image and an FsClient one
+ * user of it, with its own current directory: paths starting with '/'
+ * are resolved from the root, anything else from that directory. Calls
+ * return 0 (or a count, or an inode number) on success and one of the
+ * negative FS_E codes below on failure.
+ *
+ * Threads may share an image, each with FsClients of its own: an FsClient
+ * is used by one thread at a time. Calls that change the image (create,
+ * write, append, truncate, rm, mkdir, rmdir, ln, reflink) hold the image's
+ * transaction lock shared while they run and exclusive for their commit;
+ * fs_sync() takes it exclusive. Under it, they lock the inodes they touch:
+ * fs_read(), fs_read_to(), fs_stat(), fs_readdir() and fs_chdir() only take
+ * those read locks, so readers of a file run in parallel with each other
+ * and with changes to other files. fs_client() and fs_client_free() take
+ * the client list lock, which fs_chdir() and fs_rmdir() share for the
+ * current directories. fs_statfs() and fs_perf() lock nothing and may see
+ * a call half done. fs_open() and fs_close() must not overlap any other
+ * call on their image; different images run in parallel.
+ */
+typedef struct FileSystem FileSystem;
+typedef struct FsClient FsClient;
+
+#define FS_ENOENT -1 // no such file or directory
+#define FS_EEXIST -2
+#define FS_ENOTDIR -3
+#define FS_EISDIR -4
+#define FS_ENOTEMPTY -5
+#define FS_EBUSY -6 // a client's current directory
+#define FS_ENOSPC -7 // out of data blocks
+#define FS_ENOINODE -8
+#define FS_ENAME -9 // empty or too long name
+#define FS_EDIRFULL -10
+#define FS_EFBIG -11
+#define FS_EINVAL -12
+#define FS_ERANGE -13 // read past the end of a file
+#define FS_EIO -14
+#define FS_EMLINK -15 // a block is shared by too many files
+
+typedef struct {
+		int inode;
+		TYPE type;
+		int owner;
+		int group;
+		int size;
+		int blockCount;
+		int linkCount;
+		struct timeval created;
+		struct timeval lastAccess;
+} FsStat;
+
+typedef struct {
+		int freeBlocks;
+		int freeInodes;
+		long dcacheHits;
+		long dcacheMisses;
+		int journalStart; // 0 when the image has no journal
+		int journalBlocks;
+		int journalCommits;
+		int journalCheckpoints;
+		int journalPending; // transactions waiting for the next commit
+		int refStart; // 0 when files cannot be cloned
+		int sharedBlocks; // blocks that more than one file maps
+		DISK_MODE diskMode;
+		DiskStats cache; // DISK_CACHE mode only
+} FsStatFs;
+
+// counters of the layers below the API, see fs_perf()
+typedef struct {
+		DiskIoStats io;
+		long inodeAllocs;
+		long blockAllocs;
+		long extentAllocs; // multi-block allocations for file data
+		long inodeFrees;
+		long blockFrees;
+		long bitsScanned; // allocator map bits looked at
+} FsPerf;
+
+typedef void (*FsDirVisitor)(char *name, FsStat *st, void *arg);
+// bytes [offset, offset + size) of a new file, into buf
+typedef void (*FsFill)(char *buf, int offset, int size, void *arg);
+
+FileSystem *fs_open(char *name, DISK_MODE mode, int cacheBlocks);
+int fs_close(FileSystem *image);
+FsClient *fs_client(FileSystem *image);
+void fs_client_free(FsClient *c);
+FileSystem *fs_client_image(FsClient *c);
+
+int fs_create(FsClient *c, char *path, int size, char *data);
+int fs_create_fill(FsClient *c, char *path, int size, FsFill fill, void *arg);
+int fs_read(FsClient *c, char *path, int offset, int size, char *buf);
+int fs_read_to(FsClient *c, char *path, int offset, int size, FILE *out);
+int fs_write(FsClient *c, char *path, int offset, int size, char *data);
+int fs_append(FsClient *c, char *path, int size, char *data);
+int fs_truncate(FsClient *c, char *path, int size);
+int fs_unlink(FsClient *c, char *path);
+int fs_link(FsClient *c, char *src, char *dest);
+int fs_reflink(FsClient *c, char *src, char *dest);
+int fs_mkdir(FsClient *c, char *path);
+int fs_rmdir(FsClient *c, char *path);
+int fs_chdir(FsClient *c, char *path);
+int fs_stat(FsClient *c, char *path, FsStat *st);
+int fs_readdir(FsClient *c, char *path, FsDirVisitor visit, void *arg);
+int fs_sync(FileSystem *image, int *runs);
+int fs_statfs(FileSystem *image, FsStatFs *st);
+int fs_perf(FileSystem *image, FsPerf *perf, int reset);
+char *fs_strerror(int err);
 
-int fs_mount(char *name);
-int fs_umount(char *name);
-int execute_command(char *comm, char *arg1, char *arg2, char *arg3, char *arg4, int numArg);
+#endif
@@ -0,0 +1,1252 @@
+/*
+ * Benchmarks for the filesystem: microbenchmarks of the internals and of
+ * single calls, workloads from several threads, a stress test, and checks
+ * of the path length limit and of how the shell passes on data. Build and
+ * run with "make bench"; "./fs_bench name" runs only the benchmarks whose
+ * name starts with name.
+ *
+ * Every result is one CSV line under a header line:
+ *   bench,variant,threads,ops,ops_per_sec,p50_us,p99_us,status
+ * ops_per_sec is over the wall time of the run. The latencies are per
+ * call and include the cost of reading the clock around it, about
+ * 20-30ns. status is FAILED when a call went wrong or a check afterwards
+ * did not hold, and the exit status is then 1.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "fs_internal.h"
+#include "fs_cmd.h"
+#include "fs_util.h"
+
+#define BENCH_IMAGE "/tmp/fs_bench.dat"
+#define MAX_THREADS 8
+#define ALLOC_BATCH 64
+#define ALLOC_ROUNDS 20000
+#define LOOKUP_ENTRIES 400
+#define LOOKUP_ROUNDS 200
+#define FILE_COUNT 400
+#define FILE_SIZE 1000
+#define TINY_FILE_SIZE 32
+#define FILE_ROUNDS 5
+#define MOUNT_FILES 100
+#define MOUNT_ROUNDS 200
+#define READ_FILE_SIZE (32 * BLOCK_SIZE)
+#define READ_ROUNDS 4000
+#define CHURN_ROUNDS 300
+#define CHURN_FILES 8 // live files per thread
+#define MOSTLY_FILES 64
+#define MOSTLY_FILE_SIZE 4096
+#define MOSTLY_ROUNDS 4000
+#define DEEP_LEVELS 64
+#define DEEP_ROUNDS 2000
+#define STRESS_ROUNDS 300
+#define STRESS_FILES 8
+#define SPARSE_SIZE (1 << 22)
+#define FILL_ROUNDS 2000
+#define CLONE_ROUNDS 200
+#define CRASH_ROUNDS 20
+#define CRASH_FILES 64 // files the crash child keeps
+#define CRASH_APPEND 700
+
+static char *only; // run only benchmarks with this prefix
+static int failures;
+// what the files hold; without data fs_create() makes a hole, not blocks
+static char content[READ_FILE_SIZE];
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// call latencies of one run, in seconds
+typedef struct {
+	double *t;
+	int n;
+	int size;
+} Samples;
+
+static void sample(Samples *s, double t)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->t = realloc(s->t, s->size * sizeof(double));
+	}
+	s->t[s->n++] = t;
+}
+
+static void merge(Samples *into, Samples *from)
+{
+	int i;
+	for (i = 0; i < from->n; i++)
+		sample(into, from->t[i]);
+	free(from->t);
+	memset(from, 0, sizeof(Samples));
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(double *)a, y = *(double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// nearest-rank percentile of sorted samples
+static double percentile(Samples *s, int p)
+{
+	int i = (s->n * p + 99) / 100 - 1;
+	if (s->n == 0)
+		return 0;
+	return s->t[i < 0 ? 0 : i];
+}
+
+// print one result line and let go of its samples
+static void report(char *bench, char *variant, int threads, Samples *s, double secs, int errors)
+{
+	qsort(s->t, s->n, sizeof(double), cmp_double);
+	printf("%s,%s,%d,%d,%.0f,%.3f,%.3f,%s\n", bench, variant, threads, s->n,
+		secs > 0 ? s->n / secs : 0, percentile(s, 50) * 1e6, percentile(s, 99) * 1e6,
+		errors ? "FAILED" : "ok");
+	fflush(stdout);
+	if (errors)
+		failures++;
+	free(s->t);
+	memset(s, 0, sizeof(Samples));
+}
+
+static int selected(char *bench)
+{
+	return only == NULL || strncmp(bench, only, strlen(only)) == 0;
+}
+
+// a fresh image, so every run starts from known counts
+static FileSystem *open_fresh(DISK_MODE mode)
+{
+	unlink(BENCH_IMAGE);
+	return fs_open(BENCH_IMAGE, mode, 0);
+}
+
+static void close_image(FileSystem *image)
+{
+	fs_close(image);
+	unlink(BENCH_IMAGE);
+}
+
+typedef struct {
+	FileSystem *image;
+	int id;
+	int errors;
+	Samples lat;
+} Worker;
+
+// run fn in n threads on image and return the wall time; samples are merged into lat
+static double run_threads(FileSystem *image, int n, void *(*fn)(void *), Samples *lat, int *errors)
+{
+	pthread_t tid[MAX_THREADS];
+	Worker w[MAX_THREADS];
+	double start = now();
+	int i;
+
+	memset(w, 0, sizeof(w));
+	for (i = 0; i < n; i++) {
+		w[i].image = image;
+		w[i].id = i;
+		pthread_create(&tid[i], NULL, fn, &w[i]);
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(tid[i], NULL);
+	start = now() - start;
+	for (i = 0; i < n; i++) {
+		*errors += w[i].errors;
+		merge(lat, &w[i].lat);
+	}
+	return start;
+}
+
+static int check(Worker *w, int ret, char *what, char *path)
+{
+	if (ret < 0) {
+		fprintf(stderr, "%s %s: %s\n", what, path, fs_strerror(ret));
+		w->errors++;
+	}
+	return ret;
+}
+
+/*
+ * Allocator: get_free_block()/set_free_block() on a map filled to some
+ * degree, next to the bit-by-bit first-fit scan get_free_block() used to
+ * do, and then from several threads.
+ */
+static int linear_free_block()
+{
+	int i;
+	for (i = 0; i < MAX_BLOCK; i++) {
+		if (get_bit(fs->blockMap, i) == 0) {
+			set_bit(fs->blockMap, i, 1);
+			fs->superBlock.freeBlockCount--;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void linear_set_free_block(int i)
+{
+	set_bit(fs->blockMap, i, 0);
+	fs->superBlock.freeBlockCount++;
+}
+
+// mark roughly percent% of the block map allocated, at random positions
+static void fill_block_map(int percent)
+{
+	int i;
+
+	srand(percent);
+	memset(fs->blockMap, 0, sizeof(fs->blockMap));
+	fs->superBlock.freeBlockCount = MAX_BLOCK;
+	for (i = 0; i < MAX_BLOCK; i++) {
+		if (rand() % 100 < percent) {
+			set_bit(fs->blockMap, i, 1);
+			fs->superBlock.freeBlockCount--;
+		}
+	}
+	alloc_init();
+}
+
+// allocate a batch of blocks and give them back, keeping the fill steady
+static void alloc_rounds(int rounds, int (*alloc)(), void (*release)(int), Samples *lat, int *errors)
+{
+	int held[ALLOC_BATCH];
+	int r, i;
+	double t;
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < ALLOC_BATCH; i++) {
+			t = now();
+			held[i] = alloc();
+			sample(lat, now() - t);
+			if (held[i] < 0)
+				(*errors)++;
+		}
+		for (i = 0; i < ALLOC_BATCH; i++) {
+			if (held[i] >= 0)
+				release(held[i]);
+		}
+	}
+}
+
+static void *alloc_worker(void *arg)
+{
+	Worker *w = (Worker *)arg;
+
+	fs_bind(w->image);
+	alloc_rounds(ALLOC_ROUNDS / 4, get_free_block, set_free_block, &w->lat, &w->errors);
+	return NULL;
+}
+
+static void bench_alloc()
+{
+	FileSystem *image = open_fresh(DISK_MEMORY);
+	int fills[] = {10, 50, 95};
+	char variant[32];
+	Samples lat = {0};
+	int i, n, errors, free;
+	double secs;
+
+	for (i = 0; i < sizeof(fills) / sizeof(fills[0]); i++) {
+		errors = 0;
+		fill_block_map(fills[i]);
+		secs = now();
+		alloc_rounds(ALLOC_ROUNDS, get_free_block, set_free_block, &lat, &errors);
+		sprintf(variant, "fill%d", fills[i]);
+		report("alloc", variant, 1, &lat, now() - secs, errors);
+
+		fill_block_map(fills[i]);
+		secs = now();
+		alloc_rounds(ALLOC_ROUNDS, linear_free_block, linear_set_free_block, &lat, &errors);
+		sprintf(variant, "fill%d-linear", fills[i]);
+		report("alloc", variant, 1, &lat, now() - secs, errors);
+	}
+
+	// the free count must come out where it went in
+	for (n = 1; n <= MAX_THREADS; n *= 2) {
+		errors = 0;
+		fill_block_map(50);
+		free = free_block_count();
+		secs = run_threads(image, n, alloc_worker, &lat, &errors);
+		if (free_block_count() != free)
+			errors++;
+		report("alloc", "fill50", n, &lat, secs, errors);
+	}
+	// the map no longer matches the files
+	close_image(image);
+}
+
+// directory lookup by name in a directory of LOOKUP_ENTRIES files
+static void bench_lookup()
+{
+	FileSystem *image = open_fresh(DISK_MEMORY);
+	FsClient *c = fs_client(image);
+	char name[MAX_FILE_NAME], path[MAX_PATH];
+	Samples lat = {0};
+	int dir, i, r, errors = 0;
+	double start, t;
+
+	fs_mkdir(c, "/l");
+	for (i = 0; i < LOOKUP_ENTRIES; i++) {
+		sprintf(path, "/l/f%d", i);
+		if (fs_create(c, path, 0, NULL) < 0)
+			errors++;
+	}
+	fs_bind(image);
+	dir = dir_lookup(ROOT_INODE, "l");
+
+	start = now();
+	for (r = 0; r < LOOKUP_ROUNDS; r++) {
+		for (i = 0; i < LOOKUP_ENTRIES; i++) {
+			sprintf(name, "f%d", i);
+			t = now();
+			if (dir_lookup(dir, name) < 0)
+				errors++;
+			sample(&lat, now() - t);
+		}
+	}
+	report("lookup", "hit", 1, &lat, now() - start, errors);
+
+	start = now();
+	for (r = 0; r < LOOKUP_ROUNDS; r++) {
+		for (i = 0; i < LOOKUP_ENTRIES; i++) {
+			sprintf(name, "g%d", i);
+			t = now();
+			if (dir_lookup(dir, name) >= 0)
+				errors++;
+			sample(&lat, now() - t);
+		}
+	}
+	report("lookup", "miss", 1, &lat, now() - start, errors);
+
+	fs_client_free(c);
+	close_image(image);
+}
+
+// content for a SMALL_FILE file: rand_string() next to fill_content()
+static void bench_fill()
+{
+	char *names[] = {"rand_string", "random", "pattern"};
+	FillMode modes[] = {FILL_RANDOM, FILL_RANDOM, FILL_PATTERN};
+	char *buf = malloc(SMALL_FILE + 1);
+	Samples lat = {0};
+	double start, t;
+	int m, r;
+
+	for (m = 0; m < 3; m++) {
+		start = now();
+		for (r = 0; r < FILL_ROUNDS; r++) {
+			t = now();
+			if (m == 0)
+				rand_string(buf, SMALL_FILE);
+			else
+				fill_content(buf, 0, SMALL_FILE, modes[m], r);
+			sample(&lat, now() - t);
+		}
+		report("fill", names[m], 1, &lat, now() - start, 0);
+	}
+	free(buf);
+}
+
+// fs_create(), fs_read() and fs_unlink() of files of size bytes, each its own transaction
+static void file_rounds(FsClient *c, int size, char *variant)
+{
+	Samples create = {0}, read = {0}, unlink = {0};
+	double createTime = 0, readTime = 0, unlinkTime = 0, start, t;
+	char path[MAX_PATH], buf[FILE_SIZE];
+	int errors = 0, r, i;
+
+	for (r = 0; r < FILE_ROUNDS; r++) {
+		start = now();
+		for (i = 0; i < FILE_COUNT; i++) {
+			sprintf(path, "/m/f%d", i);
+			t = now();
+			if (fs_create(c, path, size, content) < 0)
+				errors++;
+			sample(&create, now() - t);
+		}
+		createTime += now() - start;
+
+		start = now();
+		for (i = 0; i < FILE_COUNT; i++) {
+			sprintf(path, "/m/f%d", i);
+			t = now();
+			if (fs_read(c, path, 0, size, buf) < 0)
+				errors++;
+			sample(&read, now() - t);
+		}
+		readTime += now() - start;
+
+		start = now();
+		for (i = 0; i < FILE_COUNT; i++) {
+			sprintf(path, "/m/f%d", i);
+			t = now();
+			if (fs_unlink(c, path) < 0)
+				errors++;
+			sample(&unlink, now() - t);
+		}
+		unlinkTime += now() - start;
+	}
+	report("create", variant, 1, &create, createTime, errors);
+	report("read", variant, 1, &read, readTime, errors);
+	report("unlink", variant, 1, &unlink, unlinkTime, errors);
+}
+
+// small files, tiny ones kept in the inode, and files that are all hole
+static void bench_file()
+{
+	FileSystem *image = open_fresh(DISK_MEMORY);
+	FsClient *c = fs_client(image);
+	Samples create = {0};
+	FsStat st;
+	char path[MAX_PATH];
+	double createTime, start, t;
+	int errors = 0, i;
+
+	fs_mkdir(c, "/m");
+	file_rounds(c, FILE_SIZE, "1000B");
+	file_rounds(c, TINY_FILE_SIZE, "32B");
+
+	// a file of SPARSE_SIZE bytes that is all hole costs an inode, no blocks
+	start = now();
+	for (i = 0; i < FILE_COUNT; i++) {
+		sprintf(path, "/m/s%d", i);
+		t = now();
+		if (fs_create(c, path, SPARSE_SIZE, NULL) < 0)
+			errors++;
+		sample(&create, now() - t);
+	}
+	createTime = now() - start;
+	for (i = 0; i < FILE_COUNT; i++) {
+		sprintf(path, "/m/s%d", i);
+		if (fs_stat(c, path, &st) < 0 || st.blockCount != 0)
+			errors++;
+	}
+	report("create", "sparse4MB", 1, &create, createTime, errors);
+
+	fs_client_free(c);
+	close_image(image);
+}
+
+// whole-file reads of a file of the thread's own
+static void *read_worker(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	FsClient *c = fs_client(w->image);
+	char path[MAX_PATH];
+	char *buf = malloc(READ_FILE_SIZE);
+	double t;
+	int r;
+
+	sprintf(path, "/r%d", w->id);
+	for (r = 0; r < READ_ROUNDS; r++) {
+		t = now();
+		check(w, fs_read(c, path, 0, READ_FILE_SIZE, buf), "read", path);
+		sample(&w->lat, now() - t);
+	}
+	free(buf);
+	fs_client_free(c);
+	return NULL;
+}
+
+// parallel reads of different files should scale with the threads
+static void bench_read_scaling()
+{
+	FileSystem *image = open_fresh(DISK_MEMORY);
+	FsClient *c = fs_client(image);
+	char path[MAX_PATH];
+	Samples lat = {0};
+	int i, n, errors;
+	double secs;
+
+	for (i = 0; i < MAX_THREADS; i++) {
+		sprintf(path, "/r%d", i);
+		fs_create(c, path, READ_FILE_SIZE, content);
+	}
+	for (n = 1; n <= MAX_THREADS; n *= 2) {
+		errors = 0;
+		secs = run_threads(image, n, read_worker, &lat, &errors);
+		report("read", "16KB", n, &lat, secs, errors);
+	}
+	fs_client_free(c);
+	close_image(image);
+}
+
+/*
+ * Clones of a shared file: each round clones it, writes 8 bytes into the
+ * clone, which copies one block, and checks both files read right.
+ */
+static char *cloneBase;
+
+static void *clone_worker(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	FsClient *c = fs_client(w->image);
+	char *want = malloc(READ_FILE_SIZE), *buf = malloc(READ_FILE_SIZE);
+	unsigned int seed = w->id;
+	char path[MAX_PATH];
+	int r, off;
+	double t;
+
+	sprintf(path, "/k%d", w->id);
+	for (r = 0; r < CLONE_ROUNDS; r++) {
+		off = rand_r(&seed) % (READ_FILE_SIZE - 8);
+		t = now();
+		check(w, fs_reflink(c, "/base", path), "cp --reflink", path);
+		check(w, fs_write(c, path, off, 8, "CLONED!!"), "write", path);
+		sample(&w->lat, now() - t);
+
+		memcpy(want, cloneBase, READ_FILE_SIZE);
+		memcpy(want + off, "CLONED!!", 8);
+		if (check(w, fs_read(c, path, 0, READ_FILE_SIZE, buf), "read", path) >= 0
+				&& memcmp(want, buf, READ_FILE_SIZE) != 0) {
+			fprintf(stderr, "clone %d: %s: wrong data\n", w->id, path);
+			w->errors++;
+		}
+		if (check(w, fs_read(c, "/base", 0, READ_FILE_SIZE, buf), "read", "/base") >= 0
+				&& memcmp(cloneBase, buf, READ_FILE_SIZE) != 0) {
+			fprintf(stderr, "clone %d: /base changed\n", w->id);
+			w->errors++;
+		}
+		check(w, fs_unlink(c, path), "rm", path);
+	}
+	free(want);
+	free(buf);
+	fs_client_free(c);
+	return NULL;
+}
+
+// fs_reflink() next to a copy through fs_read() and fs_create(), then clones from several threads
+static void bench_clone()
+{
+	FileSystem *image = open_fresh(DISK_MEMORY);
+	FsClient *c = fs_client(image);
+	char *buf = malloc(READ_FILE_SIZE);
+	Samples lat = {0};
+	FsStatFs before, after;
+	int errors = 0, i, n;
+	double start, t;
+
+	cloneBase = malloc(READ_FILE_SIZE);
+	fill_content(cloneBase, 0, READ_FILE_SIZE, FILL_PATTERN, 0);
+	fs_create(c, "/base", READ_FILE_SIZE, cloneBase);
+
+	start = now();
+	for (i = 0; i < FILE_COUNT; i++) {
+		t = now();
+		if (fs_reflink(c, "/base", "/k") < 0)
+			errors++;
+		sample(&lat, now() - t);
+		fs_unlink(c, "/k");
+	}
+	report("clone", "16KB", 1, &lat, now() - start, errors);
+
+	start = now();
+	for (i = 0; i < FILE_COUNT; i++) {
+		t = now();
+		if (fs_read(c, "/base", 0, READ_FILE_SIZE, buf) < 0 || fs_create(c, "/k", READ_FILE_SIZE, buf) < 0)
+			errors++;
+		sample(&lat, now() - t);
+		fs_unlink(c, "/k");
+	}
+	report("copy", "16KB", 1, &lat, now() - start, errors);
+
+	// every clone is gone at the end, and so must be every block it took
+	for (n = 1; n <= MAX_THREADS; n *= 2) {
+		errors = 0;
+		fs_statfs(image, &before);
+		start = run_threads(image, n, clone_worker, &lat, &errors);
+		fs_statfs(image, &after);
+		if (after.freeBlocks != before.freeBlocks || after.sharedBlocks != 0) {
+			fprintf(stderr, "clone: free blocks %d -> %d, %d shared\n",
+				before.freeBlocks, after.freeBlocks, after.sharedBlocks);
+			errors++;
+		}
+		report("clone", "cow", n, &lat, start, errors);
+	}
+	free(cloneBase);
+	free(buf);
+	fs_client_free(c);
+	close_image(image);
+}
+
+// fs_open() and fs_close() of an image holding some files
+static void bench_mount()
+{
+	DISK_MODE modes[] = {DISK_MMAP, DISK_MEMORY, DISK_CACHE};
+	char *names[] = {"mmap", "memory", "cache"};
+	FileSystem *image = open_fresh(DISK_MEMORY);
+	FsClient *c = fs_client(image);
+	char path[MAX_PATH];
+	Samples lat = {0};
+	int errors = 0, i, m;
+	double start, t;
+
+	for (i = 0; i < MOUNT_FILES; i++) {
+		sprintf(path, "/f%d", i);
+		fs_create(c, path, FILE_SIZE, content);
+	}
+	fs_client_free(c);
+	fs_close(image);
+
+	for (m = 0; m < 3; m++) {
+		start = now();
+		for (i = 0; i < MOUNT_ROUNDS; i++) {
+			t = now();
+			image = fs_open(BENCH_IMAGE, modes[m], 0);
+			if (image == NULL || fs_close(image) < 0)
+				errors++;
+			sample(&lat, now() - t);
+		}
+		report("mount", names[m], 1, &lat, now() - start, errors);
+	}
+	unlink(BENCH_IMAGE);
+}
+
+/*
+ * Small-file churn: every thread creates, reads back and removes files in
+ * a directory of its own, keeping CHURN_FILES of them around.
+ */
+static void *churn_worker(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	FsClient *c = fs_client(w->image);
+	unsigned int seed = w->id;
+	int size[CHURN_FILES] = {0};
+	char path[MAX_PATH], buf[SMALL_FILE];
+	int r, k;
+	double t;
+
+	sprintf(path, "/c%d", w->id);
+	check(w, fs_mkdir(c, path), "mkdir", path);
+	check(w, fs_chdir(c, path), "cd", path);
+	for (r = 0; r < CHURN_ROUNDS; r++) {
+		k = r % CHURN_FILES;
+		sprintf(path, "f%d", k);
+		if (size[k] > 0) {
+			t = now();
+			check(w, fs_unlink(c, path), "rm", path);
+			sample(&w->lat, now() - t);
+		}
+		size[k] = 1 + rand_r(&seed) % SMALL_FILE;
+		t = now();
+		check(w, fs_create(c, path, size[k], content), "create", path);
+		sample(&w->lat, now() - t);
+		t = now();
+		check(w, fs_read(c, path, 0, size[k], buf), "read", path);
+		sample(&w->lat, now() - t);
+	}
+	for (k = 0; k < CHURN_FILES; k++) {
+		sprintf(path, "f%d", k);
+		if (size[k] > 0)
+			check(w, fs_unlink(c, path), "rm", path);
+	}
+	check(w, fs_chdir(c, "/"), "cd", "/");
+	sprintf(path, "/c%d", w->id);
+	check(w, fs_rmdir(c, path), "rmdir", path);
+	fs_client_free(c);
+	return NULL;
+}
+
+/*
+ * Read-mostly: nine in ten calls read a whole shared file picked at
+ * random, the rest create or remove a file of the thread's own.
+ */
+static void *mostly_worker(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	FsClient *c = fs_client(w->image);
+	unsigned int seed = w->id;
+	char path[MAX_PATH], buf[MOSTLY_FILE_SIZE];
+	int r, exists = 0;
+	double t;
+
+	for (r = 0; r < MOSTLY_ROUNDS; r++) {
+		t = now();
+		if (rand_r(&seed) % 10 > 0) {
+			sprintf(path, "/s%d", rand_r(&seed) % MOSTLY_FILES);
+			check(w, fs_read(c, path, 0, MOSTLY_FILE_SIZE, buf), "read", path);
+		} else {
+			sprintf(path, "/w%d", w->id);
+			if (exists)
+				check(w, fs_unlink(c, path), "rm", path);
+			else
+				check(w, fs_create(c, path, MOSTLY_FILE_SIZE, content), "create", path);
+			exists = !exists;
+		}
+		sample(&w->lat, now() - t);
+	}
+	sprintf(path, "/w%d", w->id);
+	if (exists)
+		check(w, fs_unlink(c, path), "rm", path);
+	fs_client_free(c);
+	return NULL;
+}
+
+/*
+ * Deep trees: every call walks a path DEEP_LEVELS directories down, to
+ * stat the file at the bottom or replace a file of the thread's own.
+ */
+static char deepPath[MAX_PATH];
+
+static void *deep_worker(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	FsClient *c = fs_client(w->image);
+	char path[MAX_PATH];
+	FsStat st;
+	int r, n;
+	double t;
+
+	for (r = 0; r < DEEP_ROUNDS; r++) {
+		t = now();
+		if (r % 4 > 0)
+			n = snprintf(path, sizeof(path), "%s/f", deepPath);
+		else
+			n = snprintf(path, sizeof(path), "%s/t%d", deepPath, w->id);
+		// a cut off path would name some other file
+		if (n >= (int)sizeof(path)) {
+			fprintf(stderr, "deep %d: path too long\n", w->id);
+			w->errors++;
+			continue;
+		}
+		if (r % 4 > 0)
+			check(w, fs_stat(c, path, &st), "stat", path);
+		else {
+			if (r % 8 == 0)
+				check(w, fs_create(c, path, 0, NULL), "create", path);
+			else
+				check(w, fs_unlink(c, path), "rm", path);
+		}
+		sample(&w->lat, now() - t);
+	}
+	fs_client_free(c);
+	return NULL;
+}
+
+static void workload(char *name, char *variant, void *(*fn)(void *), void (*setup)(FsClient *))
+{
+	FileSystem *image;
+	FsClient *c;
+	FsStatFs before, after;
+	Samples lat = {0};
+	int n, errors;
+	double secs;
+
+	for (n = 1; n <= MAX_THREADS; n *= 2) {
+		errors = 0;
+		image = open_fresh(DISK_MEMORY);
+		c = fs_client(image);
+		if (setup != NULL)
+			setup(c);
+		fs_statfs(image, &before);
+		secs = run_threads(image, n, fn, &lat, &errors);
+		// every workload leaves the image as it found it
+		fs_statfs(image, &after);
+		if (after.freeInodes != before.freeInodes)
+			errors++;
+		report(name, variant, n, &lat, secs, errors);
+		fs_client_free(c);
+		close_image(image);
+	}
+}
+
+static void setup_mostly(FsClient *c)
+{
+	char path[MAX_PATH];
+	int i;
+
+	for (i = 0; i < MOSTLY_FILES; i++) {
+		sprintf(path, "/s%d", i);
+		fs_create(c, path, MOSTLY_FILE_SIZE, content);
+	}
+}
+
+static void setup_deep(FsClient *c)
+{
+	char path[MAX_PATH];
+	int i;
+
+	// the tree stops at the first level whose path, file included, does not fit
+	deepPath[0] = '\0';
+	for (i = 0; i < DEEP_LEVELS; i++) {
+		if (snprintf(path, sizeof(path), "%s/d/f", deepPath) >= (int)sizeof(path)) {
+			fprintf(stderr, "deep: only %d levels fit in a path\n", i);
+			failures++;
+			break;
+		}
+		strcat(deepPath, "/d");
+		fs_mkdir(c, deepPath);
+	}
+	snprintf(path, sizeof(path), "%s/f", deepPath);
+	fs_create(c, path, FILE_SIZE, content);
+}
+
+static void bench_workloads()
+{
+	if (selected("churn"))
+		workload("churn", "small", churn_worker, NULL);
+	if (selected("mostly"))
+		workload("mostly", "90read", mostly_worker, setup_mostly);
+	if (selected("deep"))
+		workload("deep", "64levels", deep_worker, setup_deep);
+}
+
+// the contents of a stress file, so a read can tell whose data it got
+static void fill_pattern(char *buf, int size, int id, int k)
+{
+	int i;
+	for (i = 0; i < size; i++)
+		buf[i] = (char)(id * 31 + k * 7 + i);
+}
+
+static void count_entry(char *name, FsStat *st, void *arg)
+{
+	(*(int *)arg)++;
+}
+
+/*
+ * One stress thread: creates, reads back, links and removes files in a
+ * directory of its own and in one shared by all threads, lists the shared
+ * one, and races the others for mkdir/rmdir of a common directory. A scratch
+ * file created and unlinked in its own directory each round frees an inode
+ * while the other threads create theirs elsewhere; an older file read back
+ * each round catches an inode or block handed out while still in use.
+ */
+static void *stress_worker(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	FsClient *c = fs_client(w->image);
+	char path[MAX_PATH], link[MAX_PATH];
+	char *data = malloc(SMALL_FILE), *back = malloc(SMALL_FILE);
+	int size[STRESS_FILES] = {0}, made[STRESS_FILES];
+	unsigned int seed = w->id;
+	int r, k, n, ret;
+	double t;
+
+	sprintf(path, "/t%d", w->id);
+	check(w, fs_mkdir(c, path), "mkdir", path);
+	check(w, fs_chdir(c, path), "cd", path);
+	for (r = 0; r < STRESS_ROUNDS; r++) {
+		t = now();
+		k = r % STRESS_FILES;
+		// drop the file this slot held before, and its link
+		if (size[k] > 0) {
+			sprintf(path, "f%d", k);
+			check(w, fs_unlink(c, path), "rm", path);
+			sprintf(link, "/shared/t%d_%d", w->id, k);
+			check(w, fs_unlink(c, link), "rm", link);
+		}
+
+		size[k] = 1 + rand_r(&seed) % SMALL_FILE;
+		made[k] = r;
+		fill_pattern(data, size[k], w->id, r);
+		sprintf(path, "f%d", k);
+		check(w, fs_create(c, path, size[k], data), "create", path);
+		sprintf(link, "/shared/t%d_%d", w->id, k);
+		check(w, fs_link(c, path, link), "ln", link);
+
+		// read it back through the link
+		if (check(w, fs_read(c, link, 0, size[k], back), "read", link) >= 0
+				&& memcmp(data, back, size[k]) != 0) {
+			fprintf(stderr, "stress %d: %s: wrong data\n", w->id, link);
+			w->errors++;
+		}
+
+		// free an inode and its blocks while the others create elsewhere
+		n = 1 + rand_r(&seed) % SMALL_FILE;
+		check(w, fs_create(c, "scratch", n, data), "create", "scratch");
+		check(w, fs_unlink(c, "scratch"), "rm", "scratch");
+
+		// an older file must still hold what was written to it
+		k = (k + 1) % STRESS_FILES;
+		if (size[k] > 0) {
+			sprintf(path, "f%d", k);
+			fill_pattern(data, size[k], w->id, made[k]);
+			if (check(w, fs_read(c, path, 0, size[k], back), "read", path) >= 0
+					&& memcmp(data, back, size[k]) != 0) {
+				fprintf(stderr, "stress %d: %s: wrong data\n", w->id, path);
+				w->errors++;
+			}
+		}
+
+		n = 0;
+		check(w, fs_readdir(c, "/shared", count_entry, &n), "ls", "/shared");
+
+		// everybody wants the same directory; only these outcomes are fine
+		ret = fs_mkdir(c, "/shared/common");
+		if (ret < 0 && ret != FS_EEXIST)
+			check(w, ret, "mkdir", "/shared/common");
+		ret = fs_rmdir(c, "/shared/common");
+		if (ret < 0 && ret != FS_ENOENT)
+			check(w, ret, "rmdir", "/shared/common");
+		sample(&w->lat, now() - t);
+	}
+
+	for (k = 0; k < STRESS_FILES; k++) {
+		if (size[k] == 0)
+			continue;
+		sprintf(path, "f%d", k);
+		check(w, fs_unlink(c, path), "rm", path);
+		sprintf(link, "/shared/t%d_%d", w->id, k);
+		check(w, fs_unlink(c, link), "rm", link);
+	}
+	check(w, fs_chdir(c, "/"), "cd", "/");
+	sprintf(path, "/t%d", w->id);
+	check(w, fs_rmdir(c, path), "rmdir", path);
+
+	free(data);
+	free(back);
+	fs_client_free(c);
+	return NULL;
+}
+
+/*
+ * Mixed create/read/ln/rm/mkdir/rmdir from N threads on one image; one
+ * sample is a round of them. When everything is removed again the free
+ * counts must be back where they started, and the image must still mount.
+ */
+static void stress(int n)
+{
+	FileSystem *image = open_fresh(DISK_MEMORY);
+	FsClient *c = fs_client(image);
+	FsStatFs before, after;
+	Samples lat = {0};
+	int errors = 0;
+	double secs;
+
+	// directories keep the blocks they grow, so /shared goes too
+	fs_statfs(image, &before);
+	fs_mkdir(c, "/shared");
+	secs = run_threads(image, n, stress_worker, &lat, &errors);
+	if (fs_rmdir(c, "/shared") < 0) {
+		fprintf(stderr, "stress: /shared is not empty\n");
+		errors++;
+	}
+	fs_statfs(image, &after);
+	if (after.freeBlocks != before.freeBlocks || after.freeInodes != before.freeInodes) {
+		fprintf(stderr, "stress: free blocks %d -> %d, free inodes %d -> %d\n",
+			before.freeBlocks, after.freeBlocks, before.freeInodes, after.freeInodes);
+		errors++;
+	}
+	fs_client_free(c);
+	fs_close(image);
+
+	image = fs_open(BENCH_IMAGE, DISK_MEMORY, 0);
+	if (image == NULL) {
+		fprintf(stderr, "stress: image does not mount again\n");
+		errors++;
+	} else
+		close_image(image);
+	report("stress", "mixed", n, &lat, secs, errors);
+}
+
+/*
+ * Paths at the length limit: a parent directory of MAX_PATH - 1 characters
+ * is looked up, one of MAX_PATH is refused with FS_ENAME. MAX_PATH is even,
+ * so "/d" levels reach MAX_PATH - 2 and a last level "dd" one more.
+ */
+static void check_paths()
+{
+	FileSystem *image = open_fresh(DISK_MEMORY);
+	FsClient *c = fs_client(image);
+	char path[MAX_PATH + 8];
+	Samples lat = {0};
+	int errors = 0, len = 0, ret;
+	double t, secs = now();
+
+	while (len + 2 <= MAX_PATH - 2) {
+		strcpy(path + len, "/d");
+		len += 2;
+		t = now();
+		if (fs_mkdir(c, path) < 0) {
+			fprintf(stderr, "paths: cannot make a level at %d characters\n", len);
+			errors++;
+			break;
+		}
+		sample(&lat, now() - t);
+	}
+
+	strcpy(path + len, "/x");
+	t = now();
+	if ((ret = fs_mkdir(c, path)) < 0) {
+		fprintf(stderr, "paths: parent of %d characters: %s\n", len + 1, fs_strerror(ret));
+		errors++;
+	}
+	sample(&lat, now() - t);
+
+	strcpy(path + len, "d");
+	fs_mkdir(c, path);
+	strcpy(path + len + 1, "/x");
+	t = now();
+	if ((ret = fs_mkdir(c, path)) != FS_ENAME) {
+		fprintf(stderr, "paths: parent of %d characters: %s instead of %s\n", len + 2,
+			ret < 0 ? fs_strerror(ret) : "made", fs_strerror(FS_ENAME));
+		errors++;
+	}
+	sample(&lat, now() - t);
+	secs = now() - secs;
+
+	fs_client_free(c);
+	close_image(image);
+	report("paths", "limit", 1, &lat, secs, errors);
+}
+
+// send stdout to /dev/null, returning what to hand speak() to get it back
+static int hush()
+{
+	int out, null;
+
+	fflush(stdout);
+	out = dup(1);
+	null = open("/dev/null", O_WRONLY);
+	dup2(null, 1);
+	close(null);
+	return out;
+}
+
+static void speak(int out)
+{
+	fflush(stdout);
+	dup2(out, 1);
+	close(out);
+}
+
+/*
+ * The data of write and append as the shell splits a line: more words
+ * than MAX_ARGS holds and runs of blanks have to reach the file as typed.
+ * The commands print, so stdout goes to /dev/null meanwhile.
+ */
+static void check_commands()
+{
+	FileSystem *image = open_fresh(DISK_MEMORY);
+	FsClient *c = fs_client(image);
+	char *lines[] = {
+		"create -q f 0\n",
+		"write f 0 one  two   three four five six seven eight\n",
+		"append f \tnine  ten \n",
+	};
+	char *want = "one  two   three four five six seven eightnine  ten ";
+	char line[128], back[128], *args[MAX_ARGS];
+	Samples lat = {0};
+	FsStat st;
+	int errors = 0, i, n, out;
+	double t, secs = now();
+
+	out = hush();
+	for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+		strcpy(line, lines[i]);
+		t = now();
+		n = split_command(line, args);
+		if (execute_command(c, n, args) < 0) {
+			fprintf(stderr, "commands: %s failed\n", args[0]);
+			errors++;
+		}
+		sample(&lat, now() - t);
+	}
+	speak(out);
+	secs = now() - secs;
+
+	n = strlen(want);
+	if (fs_stat(c, "f", &st) < 0 || st.size != n || fs_read(c, "f", 0, n, back) < 0
+			|| memcmp(back, want, n) != 0) {
+		fprintf(stderr, "commands: f does not hold the data as typed\n");
+		errors++;
+	}
+	fs_client_free(c);
+	close_image(image);
+	report("commands", "data", 1, &lat, secs, errors);
+}
+
+// the size crash file i is created with, and what an append adds to it
+static int crash_size(int i)
+{
+	return 1 + i * 397 % (4 * BLOCK_SIZE);
+}
+
+
+/*
+ * The child of a crash round: create, append to and remove files on the
+ * image in mmap mode, one byte down the pipe after each, until killed.
+ */
+static void crash_child(int pipe)
+{
+	FileSystem *image = fs_open(BENCH_IMAGE, DISK_MMAP, 0);
+	FsClient *c = fs_client(image);
+	char path[MAX_PATH];
+	int i;
+
+	fs_chdir(c, "/c");
+	for (i = 0; ; i++) {
+		sprintf(path, "f%d", i);
+		fs_create(c, path, crash_size(i), content);
+		fs_append(c, path, CRASH_APPEND, content);
+		if (i >= CRASH_FILES) {
+			sprintf(path, "f%d", i - CRASH_FILES);
+			fs_unlink(c, path);
+		}
+		if (write(pipe, "", 1) != 1)
+			_exit(1);
+	}
+}
+
+typedef struct {
+	int errors;
+	int files;
+	char inUse[MAX_INODE];
+	char names[MAX_INODE][MAX_FILE_NAME];
+} CrashCheck;
+
+// one file found after a crash: an inode of its own, and a size it had
+static void crash_entry(char *name, FsStat *st, void *arg)
+{
+	CrashCheck *cc = (CrashCheck *)arg;
+	int i;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return;
+	if (st->inode < 0 || st->inode >= MAX_INODE || cc->inUse[st->inode]++) {
+		fprintf(stderr, "crash: %s: inode %d is in another file too\n", name, st->inode);
+		cc->errors++;
+	}
+	if (sscanf(name, "f%d", &i) != 1
+			|| (st->size != crash_size(i) && st->size != crash_size(i) + CRASH_APPEND)) {
+		fprintf(stderr, "crash: %s: size %d\n", name, st->size);
+		cc->errors++;
+	}
+	if (cc->files < MAX_INODE)
+		strcpy(cc->names[cc->files++], name);
+}
+
+/*
+ * Crash in mmap mode, where everything stored lands in a shared mapping:
+ * a child process changes files in /c until it is killed, then the image
+ * is mounted again, replaying the journal. The free inode count has to
+ * match the files /c holds, no inode may be in two of them, each has a
+ * size it was given, and once they and /c are removed the free counts
+ * are those of a fresh image. One sample is a mount after a crash.
+ */
+static void crash()
+{
+	FileSystem *image = open_fresh(DISK_MMAP);
+	FsClient *c;
+	FsStatFs fresh, st;
+	CrashCheck cc;
+	Samples lat = {0};
+	char b;
+	int errors = 0, r, i, n, out, fd[2];
+	double t, secs = now();
+	pid_t pid;
+
+	fs_statfs(image, &fresh);
+	fs_close(image);
+	for (r = 0; r < CRASH_ROUNDS; r++) {
+		image = fs_open(BENCH_IMAGE, DISK_MMAP, 0);
+		c = fs_client(image);
+		fs_mkdir(c, "/c");
+		fs_client_free(c);
+		fs_close(image);
+		fflush(stdout);
+		if (pipe(fd) < 0 || (pid = fork()) < 0) {
+			fprintf(stderr, "crash: cannot start a child\n");
+			errors++;
+			break;
+		}
+		if (pid == 0) {
+			close(fd[0]);
+			hush();
+			crash_child(fd[1]);
+		}
+		// let it get some way, a different one every round
+		close(fd[1]);
+		n = 20 + r * 53 % 200;
+		for (i = 0; i < n && read(fd[0], &b, 1) == 1; i++)
+			;
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		close(fd[0]);
+
+		t = now();
+		out = hush();
+		image = fs_open(BENCH_IMAGE, DISK_MMAP, 0);
+		speak(out);
+		sample(&lat, now() - t);
+		if (image == NULL) {
+			fprintf(stderr, "crash: image does not mount after round %d\n", r);
+			errors++;
+			break;
+		}
+		c = fs_client(image);
+		memset(&cc, 0, sizeof(cc));
+		fs_chdir(c, "/c");
+		fs_readdir(c, "/c", crash_entry, &cc);
+		fs_statfs(image, &st);
+		if (st.freeInodes != fresh.freeInodes - cc.files - 1) {
+			fprintf(stderr, "crash: %d free inodes with %d files\n", st.freeInodes, cc.files);
+			cc.errors++;
+		}
+		for (i = 0; i < cc.files; i++)
+			fs_unlink(c, cc.names[i]);
+		fs_chdir(c, "/");
+		fs_rmdir(c, "/c");
+		fs_statfs(image, &st);
+		if (st.freeInodes != fresh.freeInodes || st.freeBlocks != fresh.freeBlocks) {
+			fprintf(stderr, "crash: emptied image has %d free blocks, %d free inodes; fresh %d, %d\n",
+				st.freeBlocks, st.freeInodes, fresh.freeBlocks, fresh.freeInodes);
+			cc.errors++;
+		}
+		errors += cc.errors;
+		fs_client_free(c);
+		fs_close(image);
+	}
+	report("crash", "mmap", 1, &lat, now() - secs, errors);
+	unlink(BENCH_IMAGE);
+}
+
+int main(int argc, char **argv)
+{
+	int n;
+
+	only = argc > 1 ? argv[1] : NULL;
+	memset(content, 'x', sizeof(content));
+	printf("bench,variant,threads,ops,ops_per_sec,p50_us,p99_us,status\n");
+	if (selected("alloc"))
+		bench_alloc();
+	if (selected("lookup"))
+		bench_lookup();
+	if (selected("fill"))
+		bench_fill();
+	if (selected("create") || selected("read") || selected("unlink"))
+		bench_file();
+	if (selected("read"))
+		bench_read_scaling();
+	if (selected("clone") || selected("copy"))
+		bench_clone();
+	if (selected("mount"))
+		bench_mount();
+	bench_workloads();
+	if (selected("stress")) {
+		for (n = 1; n <= MAX_THREADS; n *= 2)
+			stress(n);
+	}
+	if (selected("paths"))
+		check_paths();
+	if (selected("commands"))
+		check_commands();
+	if (selected("crash"))
+		crash();
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fs.h"
+#include "fs_cmd.h"
+#include "fs_util.h"
+
+// what to print before path so it reads as absolute
+static char *root_prefix(char *path) {
+	return path[0] == '/' ? "" : "/";
+} // root_prefix()
+
+// print why a command failed and pass the error on
+static int fail(char *what, char *path, int err) {
+	printf("%s failed: %s: %s\n", what, path, fs_strerror(err));
+	return err;
+} // fail()
+
+typedef struct {
+		FillMode mode;
+		unsigned long seed;
+} Fill;
+
+static void fill_block(char *buf, int offset, int size, void *arg) {
+	Fill *f = (Fill *)arg;
+
+	fill_content(buf, offset, size, f->mode, f->seed);
+} // fill_block()
+
+/*
+ * Create a file of random letters and digits, or of a pattern or zeros,
+ * and show what went in unless -q is given. A given seed always makes the
+ * same content; without one every file gets its own.
+ */
+static int cmd_create(FsClient *c, int argc, char **argv) {
+	int echo = strcmp(argv[1], "-q") != 0;
+	int ret;
+
+	if (!echo) {
+		argc--;
+		argv++;
+	} // if
+	if (argc < 3) {
+		printf("error: create [-q] <filename> <size> [random|zero|pattern] [seed]\n");
+		return -1;
+	} // if
+
+	int size = atoi(argv[2]);
+	Fill f = {FILL_RANDOM, 0};
+	if (argc > 3 && strcmp(argv[3], "zero") == 0)
+		f.mode = FILL_ZERO;
+	else if (argc > 3 && strcmp(argv[3], "pattern") == 0)
+		f.mode = FILL_PATTERN;
+	else if (argc > 3 && strcmp(argv[3], "random") != 0) {
+		printf("error: create [-q] <filename> <size> [random|zero|pattern] [seed]\n");
+		return -1;
+	} // if-else
+	f.seed = argc > 4 ? strtoul(argv[4], NULL, 0) : (unsigned long)rand();
+
+	if (size < 0)
+		return fail("File create", argv[1], FS_EINVAL);
+	if (size > LARGE_FILE)
+		return fail("File create", argv[1], FS_EFBIG);
+
+	// zeros are a hole; otherwise the content is made in the blocks, or first for the echo
+	if (f.mode == FILL_ZERO)
+		ret = fs_create(c, argv[1], size, NULL);
+	else if (!echo)
+		ret = fs_create_fill(c, argv[1], size, fill_block, &f);
+	else {
+		char *tmp = (char *)malloc(size + 1);
+		fill_content(tmp, 0, size, f.mode, f.seed);
+		tmp[size] = '\0';
+		ret = fs_create(c, argv[1], size, tmp);
+		if (ret >= 0)
+			printf("New File: %s\n", tmp);
+		free(tmp);
+	} // if-else
+	if (ret < 0)
+		return fail("File create", argv[1], ret);
+
+	printf("file created: %s, inode %d, size %d\n", argv[1], ret, size);
+	return 0;
+} // cmd_create()
+
+static int cmd_cat(FsClient *c, int argc, char **argv) {
+	FsStat st;
+	int ret;
+
+	if ((ret = fs_stat(c, argv[1], &st)) < 0 || (ret = fs_read_to(c, argv[1], 0, st.size, stdout)) < 0)
+		return fail("cat", argv[1], ret);
+	putchar('\n');
+	return 0;
+} // cmd_cat()
+
+static int cmd_read(FsClient *c, int argc, char **argv) {
+	int ret = fs_read_to(c, argv[1], atoi(argv[2]), atoi(argv[3]), stdout);
+
+	if (ret < 0)
+		return fail("File read", argv[1], ret);
+	putchar('\n');
+	return 0;
+} // cmd_read()
+
+// Overwrite part of a file, growing it when the data runs past its end
+static int cmd_write(FsClient *c, int argc, char **argv) {
+	int offset = atoi(argv[2]);
+	int ret;
+
+	if (offset < 0)
+		return fail("File write", argv[1], FS_EINVAL);
+	ret = fs_write(c, argv[1], offset, strlen(argv[3]), argv[3]);
+	if (ret < 0)
+		return fail("File write", argv[1], ret);
+	printf("file written: %s, %d byte(s)\n", argv[1], ret);
+	return 0;
+} // cmd_write()
+
+static int cmd_append(FsClient *c, int argc, char **argv) {
+	int ret = fs_append(c, argv[1], strlen(argv[2]), argv[2]);
+
+	if (ret < 0)
+		return fail("File write", argv[1], ret);
+	printf("file written: %s, %d byte(s)\n", argv[1], ret);
+	return 0;
+} // cmd_append()
+
+static int cmd_truncate(FsClient *c, int argc, char **argv) {
+	int ret = fs_truncate(c, argv[1], atoi(argv[2]));
+
+	if (ret < 0)
+		return fail("Truncate", argv[1], ret);
+	printf("file truncated: %s, size %d\n", argv[1], atoi(argv[2]));
+	return 0;
+} // cmd_truncate()
+
+static int cmd_stat(FsClient *c, int argc, char **argv) {
+	char timebuf[28];
+	FsStat st;
+	int ret = fs_stat(c, argv[1], &st);
+
+	if (ret < 0)
+		return fail("stat", argv[1], ret);
+	printf("Inode\t\t= %d\n", st.inode);
+	if (st.type == file)
+		printf("type\t\t= File\n");
+	else
+		printf("type\t\t= Directory\n");
+	printf("owner\t\t= %d\n", st.owner);
+	printf("group\t\t= %d\n", st.group);
+	printf("size\t\t= %d\n", st.size);
+	printf("link_count\t= %d\n", st.linkCount);
+	printf("num of block\t= %d\n", st.blockCount);
+	format_timeval(&st.created, timebuf, 28);
+	printf("Created time\t= %s\n", timebuf);
+	format_timeval(&st.lastAccess, timebuf, 28);
+	printf("Last acc. time\t= %s\n", timebuf);
+	return 0;
+} // cmd_stat()
+
+static int cmd_rm(FsClient *c, int argc, char **argv) {
+	int ret = fs_unlink(c, argv[1]);
+
+	if (ret < 0)
+		return fail("File removal", argv[1], ret);
+	printf("%s has been successfully removed\n", argv[1]);
+	return 0;
+} // cmd_rm()
+
+static int cmd_mkdir(FsClient *c, int argc, char **argv) {
+	int ret = fs_mkdir(c, argv[1]);
+
+	if (ret < 0)
+		return fail("Directory make", argv[1], ret);
+	printf("Directory \'%s%s\' created successfully\n", root_prefix(argv[1]), argv[1]);
+	return 0;
+} // cmd_mkdir()
+
+static int cmd_rmdir(FsClient *c, int argc, char **argv) {
+	int ret = fs_rmdir(c, argv[1]);
+
+	if (ret < 0)
+		return fail("Directory removal", argv[1], ret);
+	printf("%s has been successfully removed\n", argv[1]);
+	return 0;
+} // cmd_rmdir()
+
+static int cmd_cd(FsClient *c, int argc, char **argv) {
+	int ret = fs_chdir(c, argv[1]);
+
+	if (ret < 0)
+		return fail("cd", argv[1], ret);
+	printf("Current directory: \'%s%s\'\n", root_prefix(argv[1]), argv[1]);
+	return 0;
+} // cmd_cd()
+
+static void ls_entry(char *name, FsStat *st, void *arg) {
+	if (st->type == file)
+		printf("type: file, ");
+	else
+		printf("type: dir, ");
+	printf("name \"%s\", inode %d, size %d byte\n", name, st->inode, st->size);
+} // ls_entry()
+
+static int cmd_ls(FsClient *c, int argc, char **argv) {
+	char *path = argc > 1 ? argv[1] : NULL;
+	FsStat st;
+	int ret = fs_readdir(c, path, ls_entry, NULL);
+
+	// a file lists as itself
+	if (ret == FS_ENOTDIR && fs_stat(c, path, &st) == 0) {
+		ls_entry(path, &st, NULL);
+		return 0;
+	} // if
+	if (ret < 0)
+		return fail("ls", path, ret);
+	return 0;
+} // cmd_ls()
+
+static int cmd_ln(FsClient *c, int argc, char **argv) {
+	int ret = fs_link(c, argv[1], argv[2]);
+
+	if (ret < 0)
+		return fail("Hard Link", ret == FS_ENOENT || ret == FS_EISDIR ? argv[1] : argv[2], ret);
+	printf("link created: %s --> %s\n", argv[2], argv[1]);
+	return 0;
+} // cmd_ln()
+
+/*
+ * Copy a file. With --reflink the copy shares the data blocks and only
+ * the inode and pointer blocks are new, until either file is written.
+ */
+static int cmd_cp(FsClient *c, int argc, char **argv) {
+	int reflink = strcmp(argv[1], "--reflink") == 0;
+	FsStat st;
+	int ret;
+
+	if (argc != 3 + reflink) {
+		printf("error: cp [--reflink] <src> <dest>\n");
+		return -1;
+	} // if
+	char *src = argv[1 + reflink], *dest = argv[2 + reflink];
+	if (reflink)
+		ret = fs_reflink(c, src, dest);
+	else if ((ret = fs_stat(c, src, &st)) >= 0) {
+		char *data = (char *)malloc(st.size + 1);
+		if ((ret = fs_read(c, src, 0, st.size, data)) >= 0)
+			ret = fs_create(c, dest, st.size, data);
+		free(data);
+	} // if-else
+	if (ret < 0)
+		return fail("Copy", ret == FS_ENOENT || ret == FS_EISDIR ? src : dest, ret);
+	printf("file copied: %s --> %s, inode %d\n", src, dest, ret);
+	return 0;
+} // cmd_cp()
+
+static int cmd_df(FsClient *c, int argc, char **argv) {
+	FsStatFs st;
+
+	fs_statfs(fs_client_image(c), &st);
+	printf("File System Status: \n");
+	printf("# of free blocks: %d (%d bytes), # of free inodes: %d\n", st.freeBlocks, st.freeBlocks * BLOCK_SIZE, st.freeInodes);
+	printf("Dentry cache: hits %ld, misses %ld\n", st.dcacheHits, st.dcacheMisses);
+	if (st.journalStart > 0) {
+		printf("Journal: %d blocks at %d, %d commit(s), %d checkpoint(s), %d transaction(s) pending\n",
+			st.journalBlocks, st.journalStart, st.journalCommits, st.journalCheckpoints, st.journalPending);
+	} // if
+	if (st.refStart > 0)
+		printf("Shared blocks: %d\n", st.sharedBlocks);
+	if (st.diskMode == DISK_CACHE) {
+		printf("Buffer cache: %d blocks, hits %ld, misses %ld, evictions %ld, write backs %ld\n",
+			st.cache.size, st.cache.hits, st.cache.misses, st.cache.evictions, st.cache.writebacks);
+	} // if
+	return 0;
+} // cmd_df()
+
+static int cmd_sync(FsClient *c, int argc, char **argv) {
+	int runs;
+	int count = fs_sync(fs_client_image(c), &runs);
+
+	if (count < 0) {
+		printf("sync failed: %s\n", fs_strerror(count));
+		return count;
+	} // if
+	printf("sync: %d block(s) written in %d write(s)\n", count, runs);
+	return 0;
+} // cmd_sync()
+
+static int cmd_perf(FsClient *c, int argc, char **argv);
+
+/*
+ * Command table, sorted by name for bsearch(). Each handler gets the line
+ * as split_command() splits it, argv[0] the command name, and only once the
+ * argument count is within [minArgs, maxArgs].
+ */
+typedef struct {
+		char *name;
+		int (*handler)(FsClient *c, int argc, char **argv);
+		int minArgs;
+		int maxArgs;
+		char *usage;
+		int dataArg; // argv[dataArg] is the rest of the line as typed, 0 if none
+} Command;
+
+static const Command commands[] = {
+	{"append", cmd_append, 2, 2, "append <filename> <data>", 2},
+	{"cat", cmd_cat, 1, 1, "cat <filename>"},
+	{"cd", cmd_cd, 1, 1, "cd <dirname>"},
+	{"cp", cmd_cp, 2, 3, "cp [--reflink] <src> <dest>"},
+	{"create", cmd_create, 2, 5, "create [-q] <filename> <size> [random|zero|pattern] [seed]"},
+	{"df", cmd_df, 0, 0, "df"},
+	{"ln", cmd_ln, 2, 2, "ln <src> <dest>"},
+	{"ls", cmd_ls, 0, 1, "ls [path]"},
+	{"mkdir", cmd_mkdir, 1, 1, "mkdir <dirname>"},
+	{"perf", cmd_perf, 0, 1, "perf [reset]"},
+	{"read", cmd_read, 3, 3, "read <filename> <offset> <size>"},
+	{"rm", cmd_rm, 1, 1, "rm <filename>"},
+	{"rmdir", cmd_rmdir, 1, 1, "rmdir <dirname>"},
+	{"stat", cmd_stat, 1, 1, "stat <filename>"},
+	{"sync", cmd_sync, 0, 0, "sync"},
+	{"truncate", cmd_truncate, 2, 2, "truncate <filename> <size>"},
+	{"write", cmd_write, 3, 3, "write <filename> <offset> <data>", 3},
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(Command))
+
+// what execute_command() measured of each command, in table order
+typedef struct {
+		long errors;
+		Histogram latency; // nanoseconds
+} CommandStats;
+
+static CommandStats stats[NUM_COMMANDS];
+
+static double usec(long ns) {
+	return ns / 1000.0;
+} // usec()
+
+// Show where the time went: per command latencies, then block I/O and allocator counts
+static int cmd_perf(FsClient *c, int argc, char **argv) {
+	FsPerf perf;
+	int i;
+
+	if (argc > 1 && strcmp(argv[1], "reset") != 0) {
+		printf("error: perf [reset]\n");
+		return -1;
+	} // if
+	fs_perf(fs_client_image(c), &perf, argc > 1);
+	if (argc > 1) {
+		for (i = 0; i < NUM_COMMANDS; i++) {
+			hist_reset(&stats[i].latency);
+			stats[i].errors = 0;
+		} // for
+		printf("perf counters reset\n");
+		return 0;
+	} // if
+
+	printf("%-8s %8s %8s %10s %10s %10s %10s\n", "command", "calls", "errors",
+		"p50 us", "p90 us", "p99 us", "max us");
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		Histogram *h = &stats[i].latency;
+		if (h->total == 0)
+			continue;
+		printf("%-8s %8ld %8ld %10.1f %10.1f %10.1f %10.1f\n", commands[i].name, h->total,
+			stats[i].errors, usec(hist_percentile(h, 50)), usec(hist_percentile(h, 90)),
+			usec(hist_percentile(h, 99)), usec(h->max));
+	} // for
+	printf("Disk: %ld read(s), %ld bytes; %ld write(s), %ld bytes\n",
+		perf.io.reads, perf.io.readBytes, perf.io.writes, perf.io.writeBytes);
+	printf("Allocator: %ld inode, %ld block, %ld extent allocation(s); %ld inode, %ld block free(s); %ld bits scanned\n",
+		perf.inodeAllocs, perf.blockAllocs, perf.extentAllocs, perf.inodeFrees, perf.blockFrees,
+		perf.bitsScanned);
+	return 0;
+} // cmd_perf()
+
+static long now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+} // now_ns()
+
+static int compare_command(const void *name, const void *cmd) {
+	return strcmp((const char *)name, ((const Command *)cmd)->name);
+} // compare_command()
+
+static const Command *find_command(char *name) {
+	return bsearch(name, commands, NUM_COMMANDS, sizeof(Command), compare_command);
+} // find_command()
+
+/*
+ * Split a command line in place into argv: blank separated words, except
+ * that the data of write and append is the rest of the line as typed, one
+ * argument whatever words and blanks it holds, the line end dropped.
+ * Returns the argument count, which like tokenize() goes past MAX_ARGS
+ * when words had to be dropped.
+ */
+int split_command(char *line, char **argv) {
+	const Command *cmd;
+	int n = tokenize_rest(line, argv, 2);
+
+	if (n < 2)
+		return n;
+	cmd = find_command(argv[0]);
+	if (cmd != NULL && cmd->dataArg > 0)
+		return 1 + tokenize_rest(argv[1], argv + 1, cmd->dataArg);
+	return 1 + tokenize(argv[1], argv + 1, MAX_ARGS - 1);
+} // split_command()
+
+int execute_command(FsClient *c, int argc, char **argv) {
+	const Command *cmd;
+
+	if (argc < 1)
+		return 0;
+	cmd = find_command(argv[0]);
+	if (cmd == NULL) {
+		fprintf(stderr, "%s: command not found.\n", argv[0]);
+		return -1;
+	} // if
+	if (argc - 1 < cmd->minArgs) {
+		printf("error: %s\n", cmd->usage);
+		return -1;
+	} // if
+	// argc past MAX_ARGS means tokenize() dropped words, never run what is left
+	if (argc - 1 > cmd->maxArgs) {
+		printf("error: too many arguments: %s\n", cmd->usage);
+		return -1;
+	} // if
+
+	// timed with its output, which is what a user waits for
+	CommandStats *st = &stats[cmd - commands];
+	long start = now_ns();
+	int ret = cmd->handler(c, argc, argv);
+	hist_record(&st->latency, now_ns() - start);
+	if (ret < 0)
+		__atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+	return ret;
+} // execute_command()
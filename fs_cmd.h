@@ -0,0 +1,12 @@
+#ifndef FS_CMD_H
+#define FS_CMD_H
+
+#include "fs.h"
+
+// the shell commands, a client of the fs.h interface
+#define MAX_ARGS 8 // tokens per command line, the command name included
+
+int split_command(char *line, char **argv);
+int execute_command(FsClient *c, int argc, char **argv);
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef FS_INTERNAL_H
+#define FS_INTERNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "fs.h"
+#include "disk.h"
+#include "dir.h"
+#include "journal.h"
+
+/*
+ * Everything a mounted image keeps in memory. The modules below the API
+ * (fs.c, dir.c, journal.c, fs_util.c) reach it through fs, the image
+ * bound to the calling thread; every API call binds its handle first.
+ *
+ * Several threads may work on one image. A call waits for room in the
+ * journal, see journal_begin(), before it takes any lock. The locks, in
+ * the order they are taken:
+ *   txLock       shared by every call that changes metadata, exclusive
+ *                while fs_flush() copies it into a journal transaction,
+ *                so a transaction never holds half an operation
+ *   inodeLock[]  per inode; a directory's lock also covers its entries.
+ *                Directories are locked parent before child, and files
+ *                after the directories a call needs
+ *   disk lock    the block cache and the journal, see disk_lock()
+ * The dentry cache locks each set on its own. The allocator takes no
+ * locks, and the free counts in the superblock are atomic.
+ */
+
+// allocator maps, see fs_util.c; map sizes are multiples of 64 bits
+#define MAP_WORDS(nbits) ((nbits) / 64)
+#define SUM_WORDS(nbits) ((MAP_WORDS(nbits) + 63) / 64)
+
+#define ALLOC_SLOTS 16 // threads beyond this share slots
+#define SLOT_CACHE 32 // blocks a slot keeps reserved at most
+#define SLOT_BATCH 16 // blocks moved between a cache and the map at once
+
+// block reference counts: the owners of a block past the first, 16 bits each
+#define REF_BLOCKS (MAX_BLOCK * 2 / BLOCK_SIZE)
+#define REF_MAX 0xffff
+
+// allocator calls counted for fs_perf()
+enum {ALLOC_INODE, ALLOC_BLOCK, ALLOC_EXTENTS, FREE_INODE, FREE_BLOCK, ALLOC_CALLS};
+
+// one thread's allocator state, on a cache line of its own
+typedef struct {
+		int busy; // a thread is using the cache
+		int count;
+		int block[SLOT_CACHE];
+		int inodeCursor, blockCursor; // where searches start
+		long calls[ALLOC_CALLS];
+		long scanned; // map bits looked at, a 64-bit word at a time
+} __attribute__((aligned(64))) AllocSlot;
+
+struct FileSystem {
+		Disk *disk;
+		SuperBlock superBlock;
+		// claimed a 64-bit word at a time, see fs_util.c
+		char inodeMap[MAX_INODE / 8] __attribute__((aligned(8)));
+		char blockMap[MAX_BLOCK / 8] __attribute__((aligned(8)));
+
+		// inode table, filled an inode block at a time by iget()
+		Inode inode[MAX_INODE];
+		char inodeLoaded[INODE_BLOCKS / 8];
+		char inodeDirty[INODE_BLOCKS / 8];
+		char inodeAtime[INODE_BLOCKS / 8]; // changed only by touch_atime(), outside any transaction
+		pthread_mutex_t inodeLoadLock;
+		pthread_rwlock_t inodeLock[MAX_INODE];
+
+		// allocator summaries: one bit per completely allocated map word
+		uint64_t inodeFull[SUM_WORDS(MAX_INODE)];
+		uint64_t blockFull[SUM_WORDS(MAX_BLOCK)];
+		AllocSlot slot[ALLOC_SLOTS];
+
+		DirCache dcache;
+		Journal journal;
+		uint16_t ref[MAX_BLOCK]; // see share_block(), 0 for a block with one owner
+		char refDirty[(REF_BLOCKS + 7) / 8];
+		pthread_rwlock_t txLock;
+
+		FsClient *clients; // open clients, for the current directory checks
+		pthread_mutex_t clientLock;
+};
+
+struct FsClient {
+		FileSystem *image;
+		int cwd; // inode of the current directory
+		FsClient *next;
+};
+
+extern __thread FileSystem *fs;
+
+void fs_bind(FileSystem *image);
+Inode *iget(int n);
+Inode *iget_dirty(int n);
+int bmap(Inode *node, int i);
+
+int free_block_count();
+int ref_init();
+int share_block(int block);
+int unshare_block(int block);
+int block_shared(int block);
+void put_block(int block);
+void alloc_persist(SuperBlock *sb, char *map);
+void alloc_stats(FsPerf *out, int reset);
+
+static inline int free_inode_count() {
+	return __atomic_load_n(&fs->superBlock.freeInodeCount, __ATOMIC_RELAXED);
+} // free_inode_count()
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Replay a trace recorded with fs_sim -t against a copy of an image, and
+ * report throughput and latency. The commands go through the same
+ * execute_command() as in fs_sim; their output is thrown away unless -v
+ * is given. With -p the original pacing is kept, otherwise commands run
+ * back to back.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs.h"
+#include "fs_cmd.h"
+#include "fs_util.h"
+#include "trace.h"
+
+#define USAGE "usage: ./fs_replay [-d mmap|memory|cache] [-c cache_blocks] [-p] [-v] [-o copy] trace disk_name\n"
+
+// copy the image so the replay leaves the original alone
+static int copy_file(char *from, char *to)
+{
+	char buf[1 << 16];
+	size_t n;
+	FILE *in = fopen(from, "rb"), *out;
+	int ret = 0;
+
+	if(in == NULL) return -1;
+	if((out = fopen(to, "wb")) == NULL) {
+		fclose(in);
+		return -1;
+	}
+	while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if(fwrite(buf, 1, n, out) != n) {
+			ret = -1;
+			break;
+		}
+	}
+	if(ferror(in)) ret = -1;
+	fclose(in);
+	if(fclose(out) != 0) ret = -1;
+	return ret;
+}
+
+// wait until the clock reaches at
+static void sleep_until(long at)
+{
+	long wait = at - trace_clock();
+	struct timespec ts;
+
+	if(wait <= 0) return;
+	ts.tv_sec = wait / 1000000000L;
+	ts.tv_nsec = wait % 1000000000L;
+	nanosleep(&ts, NULL);
+}
+
+static void print_latency(char *what, Histogram *h)
+{
+	fprintf(stderr, "%s latency: p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", what,
+		hist_percentile(h, 50) / 1000.0, hist_percentile(h, 90) / 1000.0,
+		hist_percentile(h, 99) / 1000.0, h->max / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+	DISK_MODE mode = DISK_MMAP;
+	int cacheBlocks = 0, paced = 0, verbose = 0, opt, ret;
+	char copy[] = "/tmp/fs_replay.XXXXXX";
+	char *copyName = NULL;
+	static Histogram replayed, traced;
+	TraceRecord r;
+	FileSystem *image;
+	FsClient *c;
+	Trace *t;
+	long count = 0, start;
+	int out = -1;
+
+	while((opt = getopt(argc, argv, "d:c:pvo:")) != -1) {
+		if(opt == 'd' && strcmp(optarg, "mmap") == 0) mode = DISK_MMAP;
+		else if(opt == 'd' && strcmp(optarg, "memory") == 0) mode = DISK_MEMORY;
+		else if(opt == 'd' && strcmp(optarg, "cache") == 0) mode = DISK_CACHE;
+		else if(opt == 'c' && atoi(optarg) > 0) {
+			mode = DISK_CACHE;
+			cacheBlocks = atoi(optarg);
+		} else if(opt == 'p') paced = 1;
+		else if(opt == 'v') verbose = 1;
+		else if(opt == 'o') copyName = optarg;
+		else {
+			fprintf(stderr, USAGE);
+			return -1;
+		}
+	}
+	if(optind + 2 != argc) {
+		fprintf(stderr, USAGE);
+		return -1;
+	}
+	if((t = trace_open(argv[optind])) == NULL) {
+		fprintf(stderr, "cannot read trace %s\n", argv[optind]);
+		return -1;
+	}
+
+	// -o keeps the copy, a temporary one goes at the end
+	if(copyName == NULL) {
+		int fd = mkstemp(copy);
+		if(fd < 0) {
+			fprintf(stderr, "cannot create a copy of %s\n", argv[optind + 1]);
+			return -1;
+		}
+		close(fd);
+	}
+	if(copy_file(argv[optind + 1], copyName != NULL ? copyName : copy) < 0) {
+		fprintf(stderr, "cannot copy %s\n", argv[optind + 1]);
+		if(copyName == NULL) unlink(copy);
+		return -1;
+	}
+
+	image = fs_open(copyName != NULL ? copyName : copy, mode, cacheBlocks);
+	if(image == NULL) {
+		printf("Invalid disk!\n");
+		if(copyName == NULL) unlink(copy);
+		return -1;
+	}
+	c = fs_client(image);
+
+	// the commands print to stdout; keep it for the report only
+	if(!verbose) {
+		fflush(stdout);
+		out = dup(1);
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		close(null);
+	}
+
+	srand(0);
+	start = trace_clock();
+	while((ret = trace_read(t, &r)) > 0) {
+		long begin;
+		if(paced) sleep_until(start + r.start);
+		begin = trace_clock();
+		execute_command(c, r.argc, r.argv);
+		hist_record(&replayed, trace_clock() - begin);
+		hist_record(&traced, r.duration);
+		count++;
+	}
+	start = trace_clock() - start;
+	fflush(stdout);
+	if(out >= 0) {
+		dup2(out, 1);
+		close(out);
+	}
+	if(ret < 0) fprintf(stderr, "trace: damaged record after %ld command(s)\n", count);
+
+	double secs = start / 1e9;
+	fprintf(stderr, "replay: %ld commands in %.3f s (%.0f commands/s)%s\n", count, secs,
+		secs > 0 ? count / secs : 0.0, paced ? ", paced" : "");
+	if(count > 0) {
+		print_latency("replay", &replayed);
+		print_latency("traced", &traced);
+	}
+
+	trace_close(t);
+	fs_close(image);
+	if(copyName == NULL) unlink(copy);
+	return ret < 0 ? 1 : 0;
+}
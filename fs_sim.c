@@ -2,42 +2,153 @@
 #include <string.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "fs.h"
+#include "fs_cmd.h"
+#include "fs_util.h"
 #include "disk.h"
+#include "trace.h"
 
-bool command(char *comm, char *comm2)
+#define BATCH_BUFFER (1 << 20) // stdout buffer in batch mode
+#define USAGE "usage: ./fs [-d mmap|memory|cache] [-c cache_blocks] [-b script|-] [-t trace] disk_name\n"
+
+static Trace *trace; // where -t records the commands, NULL without it
+
+static bool is_quit(int argc, char **argv)
 {
-	if(strlen(comm) == strlen(comm2) && strncmp(comm, comm2, strlen(comm)) == 0) return true;
-	return false;
+	return argc > 0 && (strcmp(argv[0], "quit") == 0 || strcmp(argv[0], "exit") == 0);
+}
+
+/*
+ * execute_command(), recorded in the trace when there is one. A line with
+ * more than MAX_ARGS words is refused and left out: only its first words
+ * were kept, and a replay would run them.
+ */
+static void run_command(FsClient *c, int argc, char **argv)
+{
+	long start = trace_clock();
+
+	execute_command(c, argc, argv);
+	if(trace != NULL && argc > 0 && argc <= MAX_ARGS &&
+			trace_write(trace, start, trace_clock() - start, argc, argv) < 0) {
+		fprintf(stderr, "trace: write failed, no longer tracing\n");
+		trace_close(trace);
+		trace = NULL;
+	}
+}
+
+/*
+ * Run a script without prompts. Output is fully buffered, and a summary
+ * of the command rate goes to stderr at the end.
+ */
+static void run_batch(FsClient *c, FILE *in)
+{
+	char *input = NULL;
+	char *args[MAX_ARGS];
+	size_t cap = 0;
+	long count = 0;
+	struct timespec t0, t1;
+
+	setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(getline(&input, &cap, in) != -1)
+	{
+		int n = split_command(input, args);
+		if(n == 0) continue;
+		if(is_quit(n, args)) break;
+		run_command(c, n, args);
+		count++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fflush(stdout);
+	free(input);
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stderr, "batch: %ld commands in %.3f s (%.0f commands/s)\n", count, secs, secs > 0 ? count / secs : 0.0);
 }
 
 int main(int argc, char **argv)
 {
-	char input[64+16+16+16+SMALL_FILE];
-	char comm[64], arg1[16], arg2[16], arg3[16], arg4[SMALL_FILE];
+	char *input = NULL;
+	char *args[MAX_ARGS];
+	size_t cap = 0;
+	char *script = NULL;
+	FILE *in = stdin;
+	DISK_MODE mode = DISK_MMAP;
+	int cacheBlocks = 0;
+	char *traceName = NULL;
+	FileSystem *image;
+	FsClient *c;
+
+	int opt;
 
 	srand(0);
 
-	if(argc < 2) {
-		fprintf(stderr, "usage: ./fs disk_name\n");
+	while((opt = getopt(argc, argv, "d:c:b:t:")) != -1) {
+		if(opt == 'd' && strcmp(optarg, "mmap") == 0) mode = DISK_MMAP;
+		else if(opt == 'd' && strcmp(optarg, "memory") == 0) mode = DISK_MEMORY;
+		else if(opt == 'd' && strcmp(optarg, "cache") == 0) mode = DISK_CACHE;
+		else if(opt == 'c' && atoi(optarg) > 0) {
+			mode = DISK_CACHE;
+			cacheBlocks = atoi(optarg);
+		} else if(opt == 'b') {
+			script = optarg;
+		} else if(opt == 't') {
+			traceName = optarg;
+		} else {
+			fprintf(stderr, USAGE);
+			return -1;
+		}
+	}
+	if(optind >= argc) {
+		fprintf(stderr, USAGE);
 		return -1;
 	}
+	argv += optind - 1;
 	srand(0);
-		
-	printf("sizeof inode: %d, sizeof superblock: %d, sizeof Dentry: %d\n", sizeof(Inode), sizeof(SuperBlock), sizeof(Dentry));
-	fs_mount(argv[1]);
+
+	if(script != NULL) {
+		if(strcmp(script, "-") != 0 && (in = fopen(script, "r")) == NULL) {
+			fprintf(stderr, "cannot open script %s\n", script);
+			return -1;
+		}
+	} else {
+		printf("sizeof inode: %d, sizeof superblock: %d, sizeof Dentry: %d\n", sizeof(Inode), sizeof(SuperBlock), sizeof(Dentry));
+	}
+
+	image = fs_open(argv[1], mode, cacheBlocks);
+	if(image == NULL) {
+		printf("Invalid disk!\n");
+		return 0;
+	}
+	c = fs_client(image);
+	if(traceName != NULL && (trace = trace_create(traceName)) == NULL) {
+		fprintf(stderr, "cannot create trace %s\n", traceName);
+		fs_close(image);
+		return -1;
+	}
+
+	if(script != NULL) {
+		run_batch(c, in);
+		fs_close(image);
+		if(in != stdin) fclose(in);
+		if(trace != NULL) trace_close(trace);
+		return 0;
+	}
+
 	printf("%% ");
-	while(fgets(input, 256, stdin))
+	while(getline(&input, &cap, stdin) != -1)
 	{
-		bzero(comm,64); bzero(arg1,16); bzero(arg2,16); bzero(arg3,16); bzero(arg4, SMALL_FILE);
-		int numArg = sscanf(input, "%s %s %s %s %s", comm, arg1, arg2, arg3, arg4);
-		if(command(comm, "quit")) break;
-		else if(command(comm, "exit")) break;
-		else execute_command(comm, arg1, arg2, arg3, arg4, numArg - 1);
+		int n = split_command(input, args);
+		if(is_quit(n, args)) break;
+		printf("\n");
+		run_command(c, n, args);
 
 		printf("%% ");
 	}
+	free(input);
 
-	fs_umount(argv[1]);
+	fs_close(image);
+	if(trace != NULL) trace_close(trace);
 }
-
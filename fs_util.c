@@ -1,7 +1,58 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
 #include <time.h>
-#include "fs.h"
+#include "fs_internal.h"
+#include "fs_util.h"
+
+/*
+ * Split line in place at runs of blanks. Up to max tokens are stored in
+ * argv; the return value counts all of them, so a result above max means
+ * some were dropped.
+ */
+int tokenize(char *line, char **argv, int max)
+{
+	int n = 0;
+	char *p = line;
+
+	for(;;) {
+		while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+		if(*p == '\0') break;
+		if(n < max) argv[n] = p;
+		n++;
+		while(*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+		if(*p == '\0') break;
+		*p++ = '\0';
+	}
+	return n;
+}
+
+/*
+ * Split off the first n - 1 words of line like tokenize() and store the
+ * rest of it, from the next word to the line end but for the newline, as
+ * the n-th. Returns how many of the n were there.
+ */
+int tokenize_rest(char *line, char **argv, int n)
+{
+	int i = 0;
+	size_t len;
+	char *p = line;
+
+	for(;;) {
+		while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+		if(*p == '\0') return i;
+		argv[i++] = p;
+		if(i == n) break;
+		while(*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+		if(*p == '\0') return i;
+		*p++ = '\0';
+	}
+	len = strlen(p);
+	while(len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r')) p[--len] = '\0';
+	return i;
+}
 
 int rand_string(char *str, size_t size)
 {
@@ -16,6 +67,75 @@ int rand_string(char *str, size_t size)
 	return size+1;
 }
 
+// splitmix64 finalizer: a well mixed 64-bit value for every counter value
+static uint64_t mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// the low byte of r scaled to a letter or digit, a multiply rather than a division
+static char alnum(uint64_t r)
+{
+	static const char charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	return charset[(int)(r & 0xff) * 62 >> 8];
+}
+
+/*
+ * Bytes [offset, offset + size) of the content a file of the given fill
+ * gets, into buf. Every 8-byte word is worked out from its offset alone,
+ * so blocks can be filled in any order and the same seed always gives the
+ * same content:
+ *   FILL_RANDOM   letters and digits, one mix64() per 8 of them
+ *   FILL_PATTERN  16-byte lines holding their own offset in hex
+ *   FILL_ZERO     zeros
+ */
+void fill_content(char *buf, long offset, int size, FillMode mode, unsigned long seed)
+{
+	static const char hex[] = "0123456789abcdef";
+	long pos;
+	int i, k;
+
+	if(mode == FILL_ZERO) {
+		memset(buf, 0, size);
+		return;
+	}
+	if(mode == FILL_PATTERN) {
+		for(i = 0; i < size; i++) {
+			pos = offset + i;
+			k = pos & 15;
+			buf[i] = k == 15 ? '\n' : hex[((pos & ~15L) >> (4 * (14 - k))) & 15];
+		}
+		return;
+	}
+	for(i = 0; i < size; ) {
+		pos = offset + i;
+		uint64_t r = mix64(seed + (uint64_t)(pos >> 3) * 0x9e3779b97f4a7c15ULL);
+		k = pos & 7;
+		if(k == 0 && i + 8 <= size) {
+			// whole words, the common case, in a loop of fixed length
+			for(k = 0; k < 8; k++)
+				buf[i + k] = alnum(r >> (8 * k));
+			i += 8;
+			continue;
+		}
+		for(; k < 8 && i < size; k++, i++)
+			buf[i] = alnum(r >> (8 * k));
+	}
+}
+
+// 32-bit FNV-1a hash of a file name
+unsigned int name_hash(char *name)
+{
+	unsigned int h = 2166136261u;
+	while(*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
 void toggle_bit(char *array, int index)
 {
 	array[index/8] ^= 1 << (index % 8);
@@ -34,47 +154,610 @@ void set_bit(char *array, int index, char value)
 	toggle_bit(array, index);
 }
 
-int get_free_inode()
+// get_bit() and set_bit() for maps other threads change at the same time
+char get_bit_atomic(char *array, int index)
 {
-	int i = 0;
-	for(i = 0; i < MAX_INODE; i++)
-	{
-		if(get_bit(inodeMap, i) == 0) {
-			set_bit(inodeMap, i, 1);
-			superBlock.freeInodeCount--;
-			return i;
+	return 1 & (__atomic_load_n(&array[index/8], __ATOMIC_ACQUIRE) >> (index % 8));
+}
+
+void set_bit_atomic(char *array, int index, char value)
+{
+	if(value) __atomic_fetch_or(&array[index/8], 1 << (index % 8), __ATOMIC_RELEASE);
+	else __atomic_fetch_and(&array[index/8], ~(1 << (index % 8)), __ATOMIC_RELEASE);
+}
+
+/*
+ * Bitmap allocator. The maps are scanned a 64-bit word at a time and a
+ * summary level keeps one bit per word that is completely allocated, so
+ * full stretches of the map are skipped without being loaded. Map sizes
+ * are multiples of 64 bits.
+ *
+ * No locks: bits are claimed and released with compare-and-swap on whole
+ * map words, and the summary is only a hint that is put right after the
+ * fact. Every thread uses one of the image's AllocSlots, which holds the
+ * cursors its searches start from (spread over the maps, so threads do
+ * not fight over the same words) and a small cache of reserved blocks.
+ * Blocks move between a cache and the map SLOT_BATCH at a time. A cached
+ * block is allocated in the map in memory but free on disk, see
+ * alloc_persist(), and free_block_count() counts it as free.
+ */
+static int nextSlot;
+static __thread int mySlot = -1;
+
+static int slot_index()
+{
+	if (mySlot < 0)
+		mySlot = __atomic_fetch_add(&nextSlot, 1, __ATOMIC_RELAXED) % ALLOC_SLOTS;
+	return mySlot;
+}
+
+// counters go in the thread's own slot, so counting costs no sharing
+static void count_call(int call)
+{
+	__atomic_fetch_add(&fs->slot[slot_index()].calls[call], 1, __ATOMIC_RELAXED);
+}
+
+static void count_scan(int words)
+{
+	__atomic_fetch_add(&fs->slot[slot_index()].scanned, (long)words * 64, __ATOMIC_RELAXED);
+}
+
+static uint64_t *map_word(char *array, int w)
+{
+	return (uint64_t *)(array + w * 8);
+}
+
+static uint64_t load_word(char *array, int w)
+{
+	return le64toh(__atomic_load_n(map_word(array, w), __ATOMIC_ACQUIRE));
+}
+
+static void update_summary(char *array, uint64_t *full, int index)
+{
+	int w = index / 64;
+	if (load_word(array, w) == ~0ULL)
+		full[w / 64] |= 1ULL << (w % 64);
+	else
+		full[w / 64] &= ~(1ULL << (w % 64));
+}
+
+static void init_summary(char *array, int nbits, uint64_t *full)
+{
+	int w;
+	memset(full, 0, SUM_WORDS(nbits) * 8);
+	for (w = 0; w < MAP_WORDS(nbits); w++)
+		update_summary(array, full, w * 64);
+	// words past the end of the map count as full
+	for (w = MAP_WORDS(nbits); w < SUM_WORDS(nbits) * 64; w++)
+		full[w / 64] |= 1ULL << (w % 64);
+}
+
+/*
+ * Mark word w full in the summary after filling it. A release may have
+ * come in between, and it clears the bit after its own change to the
+ * word, so look again after setting it.
+ */
+static void mark_full(char *array, uint64_t *full, int w)
+{
+	__atomic_fetch_or(&full[w / 64], 1ULL << (w % 64), __ATOMIC_SEQ_CST);
+	if (load_word(array, w) != ~0ULL)
+		__atomic_fetch_and(&full[w / 64], ~(1ULL << (w % 64)), __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Claim up to max clear bits of word w at or after bit from, lowest
+ * first, with one compare-and-swap. Returns the bits claimed, 0 if there
+ * were none.
+ */
+static uint64_t claim_any(char *array, uint64_t *full, int w, int from, int max)
+{
+	uint64_t *p = map_word(array, w);
+	uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED), want, free;
+	int i;
+
+	count_scan(1);
+	do {
+		free = ~le64toh(old) & (~0ULL << from);
+		for (want = 0, i = 0; i < max && free; i++) {
+			want |= free & -free;
+			free &= free - 1;
 		}
-	}
+		if (want == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(p, &old, old | htole64(want), 1,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	if ((le64toh(old) | want) == ~0ULL)
+		mark_full(array, full, w);
+	return want;
+}
+
+// claim exactly the bits of mask in word w; 0 if some are taken already
+static int claim_bits(char *array, uint64_t *full, int w, uint64_t mask)
+{
+	uint64_t *p = map_word(array, w);
+	uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
 
+	count_scan(1);
+	do {
+		if (le64toh(old) & mask)
+			return 0;
+	} while (!__atomic_compare_exchange_n(p, &old, old | htole64(mask), 1,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	if ((le64toh(old) | mask) == ~0ULL)
+		mark_full(array, full, w);
+	return 1;
+}
+
+static void release_bits(char *array, uint64_t *full, int w, uint64_t mask)
+{
+	__atomic_fetch_and(map_word(array, w), ~htole64(mask), __ATOMIC_RELEASE);
+	__atomic_fetch_and(&full[w / 64], ~(1ULL << (w % 64)), __ATOMIC_SEQ_CST);
+}
+
+// the first word at or after w that is not full, wrapping around; -1 if none
+static int next_open_word(int nbits, uint64_t *full, int w)
+{
+	int nsum = SUM_WORDS(nbits), k;
+
+	for (k = 0; k <= nsum; k++) {
+		int s = (w / 64 + k) % nsum;
+		uint64_t cand = ~__atomic_load_n(&full[s], __ATOMIC_RELAXED);
+		if (k == 0)
+			cand &= ~0ULL << (w % 64);
+		if (cand != 0) {
+			count_scan(k + 1);
+			return s * 64 + __builtin_ctzll(cand);
+		}
+	}
+	count_scan(nsum + 1);
 	return -1;
 }
 
-int get_free_block()
+/*
+ * Claim up to max clear bits, all from one word, starting the search at
+ * *cursor and moving the cursor past them. The bits go into out[];
+ * returns how many there are, 0 when the map is full.
+ */
+static int alloc_bits(char *array, int nbits, uint64_t *full, int *cursor, int max, int *out)
 {
-	int i = 0;
+	int hint = __atomic_load_n(cursor, __ATOMIC_RELAXED);
+	int w = hint / 64, from = hint % 64, tries, n = 0;
+	uint64_t got = 0;
+
+	for (tries = 0; tries <= MAP_WORDS(nbits) && got == 0; tries++) {
+		got = claim_any(array, full, w, from, max);
+		if (got != 0)
+			break;
+		// the summary may be behind; a whole pass finding nothing means full
+		w = next_open_word(nbits, full, (w + 1) % MAP_WORDS(nbits));
+		if (w < 0)
+			return 0;
+		from = 0;
+	}
+	while (got) {
+		out[n++] = w * 64 + __builtin_ctzll(got);
+		got &= got - 1;
+	}
+	if (n > 0)
+		__atomic_store_n(cursor, (out[n - 1] + 1) % nbits, __ATOMIC_RELAXED);
+	return n;
+}
+
+// give bits back to the map, one atomic update per word they fall in
+static void release_batch(char *array, uint64_t *full, int *bits, int n)
+{
+	int i, j;
 
-	for(i = 0; i < MAX_BLOCK; i++) {
-		if(get_bit(blockMap, i) == 0) {
-			set_bit(blockMap, i, 1);
-			superBlock.freeBlockCount--;
-			return i;
+	for (i = 0; i < n; i++) {
+		if (bits[i] < 0)
+			continue;
+		int w = bits[i] / 64;
+		uint64_t mask = 0;
+		for (j = i; j < n; j++) {
+			if (bits[j] >= 0 && bits[j] / 64 == w) {
+				mask |= 1ULL << (bits[j] % 64);
+				bits[j] = -1;
+			}
 		}
+		release_bits(array, full, w, mask);
+	}
+}
+
+// the calling thread's slot to use the cache of, NULL if another thread has it
+static AllocSlot *slot_get(int i)
+{
+	AllocSlot *s = &fs->slot[i];
+	if (__atomic_exchange_n(&s->busy, 1, __ATOMIC_ACQUIRE))
+		return NULL;
+	return s;
+}
+
+static void slot_put(AllocSlot *s)
+{
+	__atomic_store_n(&s->busy, 0, __ATOMIC_RELEASE);
+}
+
+// return the oldest n blocks of a slot's cache to the map
+static void slot_return(AllocSlot *s, int n)
+{
+	int batch[SLOT_CACHE];
+
+	memcpy(batch, s->block, n * sizeof(int));
+	memmove(s->block, s->block + n, (s->count - n) * sizeof(int));
+	// the blocks stay counted as free throughout
+	__atomic_fetch_add(&fs->superBlock.freeBlockCount, n, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->count, s->count - n, __ATOMIC_RELAXED);
+	release_batch(fs->blockMap, fs->blockFull, batch, n);
+}
+
+// empty every cache no thread is using, when the map has run out
+static void drain_caches()
+{
+	AllocSlot *s;
+	int i;
+
+	for (i = 0; i < ALLOC_SLOTS; i++) {
+		if ((s = slot_get(i)) == NULL)
+			continue;
+		if (s->count > 0)
+			slot_return(s, s->count);
+		slot_put(s);
+	}
+}
+
+void alloc_init()
+{
+	int i;
+
+	init_summary(fs->inodeMap, MAX_INODE, fs->inodeFull);
+	init_summary(fs->blockMap, MAX_BLOCK, fs->blockFull);
+	for (i = 0; i < ALLOC_SLOTS; i++) {
+		memset(&fs->slot[i], 0, sizeof(AllocSlot));
+		fs->slot[i].inodeCursor = i * (MAX_INODE / ALLOC_SLOTS);
+		fs->slot[i].blockCursor = i * (MAX_BLOCK / ALLOC_SLOTS);
+	}
+}
+
+// blocks free on disk: free in the map or reserved in a cache
+int free_block_count()
+{
+	int n = __atomic_load_n(&fs->superBlock.freeBlockCount, __ATOMIC_RELAXED);
+	int i;
+
+	for (i = 0; i < ALLOC_SLOTS; i++)
+		n += __atomic_load_n(&fs->slot[i].count, __ATOMIC_RELAXED);
+	return n;
+}
+
+/*
+ * The superblock and block map as they go to disk, with the blocks held
+ * in caches free. The caller keeps allocations out meanwhile.
+ */
+void alloc_persist(SuperBlock *sb, char *map)
+{
+	int i, j;
+
+	memcpy(sb, &fs->superBlock, sizeof(SuperBlock));
+	sb->freeBlockCount = free_block_count();
+	memcpy(map, fs->blockMap, MAX_BLOCK / 8);
+	for (i = 0; i < ALLOC_SLOTS; i++) {
+		for (j = 0; j < fs->slot[i].count; j++)
+			set_bit(map, fs->slot[i].block[j], 0);
 	}
+}
 
+// the allocator counters of every slot added up, zeroed afterwards when reset is set
+void alloc_stats(FsPerf *out, int reset)
+{
+	long calls[ALLOC_CALLS] = {0}, scanned = 0;
+	int i, k;
+
+	for (i = 0; i < ALLOC_SLOTS; i++) {
+		for (k = 0; k < ALLOC_CALLS; k++)
+			calls[k] += reset ? __atomic_exchange_n(&fs->slot[i].calls[k], 0, __ATOMIC_RELAXED)
+				: __atomic_load_n(&fs->slot[i].calls[k], __ATOMIC_RELAXED);
+		scanned += reset ? __atomic_exchange_n(&fs->slot[i].scanned, 0, __ATOMIC_RELAXED)
+			: __atomic_load_n(&fs->slot[i].scanned, __ATOMIC_RELAXED);
+	}
+	out->inodeAllocs = calls[ALLOC_INODE];
+	out->blockAllocs = calls[ALLOC_BLOCK];
+	out->extentAllocs = calls[ALLOC_EXTENTS];
+	out->inodeFrees = calls[FREE_INODE];
+	out->blockFrees = calls[FREE_BLOCK];
+	out->bitsScanned = scanned;
+}
+
+int get_free_inode()
+{
+	int i;
+
+	count_call(ALLOC_INODE);
+	if (alloc_bits(fs->inodeMap, MAX_INODE, fs->inodeFull,
+			&fs->slot[slot_index()].inodeCursor, 1, &i) == 0)
 		return -1;
+	__atomic_fetch_sub(&fs->superBlock.freeInodeCount, 1, __ATOMIC_RELAXED);
+	return i;
 }
 
+int get_free_block()
+{
+	int si = slot_index(), n, i;
+	AllocSlot *s = slot_get(si);
+
+	count_call(ALLOC_BLOCK);
+	// another thread on the same slot: straight from the map
+	if (s == NULL) {
+		if (alloc_bits(fs->blockMap, MAX_BLOCK, fs->blockFull, &fs->slot[si].blockCursor, 1, &i) == 0)
+			return -1;
+		__atomic_fetch_sub(&fs->superBlock.freeBlockCount, 1, __ATOMIC_RELAXED);
+		return i;
+	}
+
+	if (s->count == 0) {
+		n = alloc_bits(fs->blockMap, MAX_BLOCK, fs->blockFull, &s->blockCursor, SLOT_BATCH, s->block);
+		if (n == 0) {
+			// what is left may sit in other caches
+			slot_put(s);
+			drain_caches();
+			s = slot_get(si);
+			n = s == NULL ? 0 : alloc_bits(fs->blockMap, MAX_BLOCK, fs->blockFull, &s->blockCursor, SLOT_BATCH, s->block);
+			if (n == 0) {
+				if (s != NULL)
+					slot_put(s);
+				return -1;
+			}
+		}
+		// taken from the end, so hand them out in map order
+		for (i = 0; i < n / 2; i++) {
+			int t = s->block[i];
+			s->block[i] = s->block[n - 1 - i];
+			s->block[n - 1 - i] = t;
+		}
+		__atomic_fetch_sub(&fs->superBlock.freeBlockCount, n, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->count, n, __ATOMIC_RELAXED);
+	}
+	// what was just freed goes out first
+	i = s->block[s->count - 1];
+	__atomic_store_n(&s->count, s->count - 1, __ATOMIC_RELAXED);
+	slot_put(s);
+	return i;
+}
+
+// first bit at or after from that equals value, or nbits if there is none
+static int next_bit(char *array, int nbits, int from, int value)
+{
+	int w = from / 64;
+	uint64_t word;
+
+	if (from >= nbits) return nbits;
+	word = load_word(array, w);
+	if (!value) word = ~word;
+	word &= ~0ULL << (from % 64);
+	while (word == 0) {
+		if (++w >= MAP_WORDS(nbits)) break;
+		word = load_word(array, w);
+		if (!value) word = ~word;
+	}
+	count_scan(w - from / 64 + (w < MAP_WORDS(nbits)));
+	if (w >= MAP_WORDS(nbits)) return nbits;
+	return w * 64 + __builtin_ctzll(word);
+}
+
+/*
+ * Pick the free run to allocate from: the smallest run holding want
+ * blocks, or the largest run there is when none is long enough. Other
+ * threads may take part of it before it is claimed.
+ */
+static int find_free_run(int want, int *len)
+{
+	int best = -1, bestLen = 0, big = -1, bigLen = 0;
+	int p = 0, end;
+
+	while ((p = next_bit(fs->blockMap, MAX_BLOCK, p, 0)) < MAX_BLOCK) {
+		end = next_bit(fs->blockMap, MAX_BLOCK, p, 1);
+		if (end - p >= want && (best < 0 || end - p < bestLen)) {
+			best = p;
+			bestLen = end - p;
+			if (bestLen == want) break;
+		}
+		if (end - p > bigLen) {
+			big = p;
+			bigLen = end - p;
+		}
+		p = end;
+	}
+	if (best >= 0) {
+		*len = bestLen;
+		return best;
+	}
+	*len = bigLen;
+	return big;
+}
+
+// claim blocks [start, start + len) a word at a time, all or nothing
+static int claim_run(int start, int len)
+{
+	int i = start, end = start + len;
+
+	while (i < end) {
+		int w = i / 64, n = 64 - i % 64;
+		if (n > end - i) n = end - i;
+		uint64_t mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << (i % 64);
+		if (!claim_bits(fs->blockMap, fs->blockFull, w, mask)) {
+			// undo the words claimed so far
+			while (start < i) {
+				w = start / 64;
+				n = 64 - start % 64;
+				if (n > i - start) n = i - start;
+				release_bits(fs->blockMap, fs->blockFull, w,
+					(n == 64 ? ~0ULL : (1ULL << n) - 1) << (start % 64));
+				start += n;
+			}
+			return 0;
+		}
+		i += n;
+	}
+	return 1;
+}
+
+/*
+ * Allocate n data blocks into blocks[] using as few runs of consecutive
+ * blocks (extents) as possible. Returns the number of extents, or -1 when
+ * fewer than n blocks are free. A run another thread gets to first is
+ * replaced by whatever one word still has free, so this always ends.
+ */
+int get_free_blocks(int *blocks, int n)
+{
+	int got = 0, extents = 0, drained = 0, i, len, start;
+	AllocSlot *s;
+
+	count_call(ALLOC_EXTENTS);
+	if (n > free_block_count()) return -1;
+
+	// this thread's reserved blocks may be what makes a run long enough
+	if ((s = slot_get(slot_index())) != NULL) {
+		if (s->count > 0)
+			slot_return(s, s->count);
+		slot_put(s);
+	}
+
+	while (got < n) {
+		start = find_free_run(n - got, &len);
+		if (len > n - got) len = n - got;
+		if (start >= 0 && claim_run(start, len)) {
+			for (i = start; i < start + len; i++)
+				blocks[got++] = i;
+			fs->slot[slot_index()].blockCursor = (start + len) % MAX_BLOCK;
+		} else {
+			len = alloc_bits(fs->blockMap, MAX_BLOCK, fs->blockFull,
+				&fs->slot[slot_index()].blockCursor, n - got < 64 ? n - got : 64, blocks + got);
+			if (len == 0) {
+				// the rest may sit in caches
+				if (!drained++) {
+					drain_caches();
+					continue;
+				}
+				for (i = 0; i < got; i++) set_free_block(blocks[i]);
+				return -1;
+			}
+			got += len;
+		}
+		__atomic_fetch_sub(&fs->superBlock.freeBlockCount, len, __ATOMIC_RELAXED);
+		extents++;
+	}
+	return extents;
+}
 
 void set_free_inode(int i) {
-	set_bit(inodeMap, i, 0);
-	superBlock.freeInodeCount++;
+	count_call(FREE_INODE);
+	release_bits(fs->inodeMap, fs->inodeFull, i / 64, 1ULL << (i % 64));
+	__atomic_fetch_add(&fs->superBlock.freeInodeCount, 1, __ATOMIC_RELAXED);
 } // set_free_inode()
 
 void set_free_block(int i) {
-	set_bit(blockMap, i, 0);
-	superBlock.freeBlockCount++;
+	AllocSlot *s = slot_get(slot_index());
+
+	count_call(FREE_BLOCK);
+	if (s == NULL) {
+		release_bits(fs->blockMap, fs->blockFull, i / 64, 1ULL << (i % 64));
+		__atomic_fetch_add(&fs->superBlock.freeBlockCount, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	// the block stays reserved in the cache; a full cache goes back in part
+	if (s->count == SLOT_CACHE)
+		slot_return(s, SLOT_BATCH);
+	s->block[s->count] = i;
+	__atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+	slot_put(s);
 } // set_free_block()
 
+/*
+ * Set up the block reference counts, carving their blocks out of the free
+ * ones the first time an image is mounted, as one extent like the journal.
+ * Without them files cannot be cloned. Call after journal_init().
+ */
+int ref_init()
+{
+	int blocks[REF_BLOCKS];
+	int i, n = -1;
+
+	if (fs->superBlock.refStart > 0) {
+		disk_read_blocks(fs->superBlock.refStart, REF_BLOCKS, (char *)fs->ref);
+		memset(fs->refDirty, 0, sizeof(fs->refDirty));
+		return 0;
+	}
+	memset(fs->ref, 0, sizeof(fs->ref));
+	if (REF_BLOCKS <= free_block_count())
+		n = get_free_blocks(blocks, REF_BLOCKS);
+	if (n != 1) {
+		if (n > 1) {
+			for (i = 0; i < REF_BLOCKS; i++)
+				set_free_block(blocks[i]);
+		}
+		printf("refcount: no room for %d blocks of reference counts, files cannot be cloned\n", REF_BLOCKS);
+		return -1;
+	}
+	fs->superBlock.refStart = blocks[0];
+	fs->superBlock.refBlocks = REF_BLOCKS;
+	// fs_flush() writes them out zeroed
+	memset(fs->refDirty, 0xff, sizeof(fs->refDirty));
+	return 0;
+}
+
+static void ref_dirty(int block)
+{
+	set_bit_atomic(fs->refDirty, block * 2 / BLOCK_SIZE, 1);
+}
+
+/*
+ * Add an owner to a block, for a clone. Returns -1 when the block has
+ * REF_MAX owners past the first already.
+ */
+int share_block(int block)
+{
+	uint16_t old = __atomic_load_n(&fs->ref[block], __ATOMIC_RELAXED);
+
+	do {
+		if (old == REF_MAX) return -1;
+	} while (!__atomic_compare_exchange_n(&fs->ref[block], &old, old + 1, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	ref_dirty(block);
+	return 0;
+}
+
+/*
+ * Drop one owner of a block if it has more than one. Returns 1 when it
+ * did: the caller no longer owns the block and must not write it. 0 means
+ * the caller is the only owner left. Of two owners letting go at once,
+ * exactly one gets 1, and the other may then write the block in place.
+ */
+int unshare_block(int block)
+{
+	uint16_t old = __atomic_load_n(&fs->ref[block], __ATOMIC_ACQUIRE);
+
+	while (old > 0) {
+		if (__atomic_compare_exchange_n(&fs->ref[block], &old, old - 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			ref_dirty(block);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// whether a block has more than one owner, so a write has to copy it first
+int block_shared(int block)
+{
+	return __atomic_load_n(&fs->ref[block], __ATOMIC_ACQUIRE) > 0;
+}
+
+// let go of a file data block: free it, unless another file still has it
+void put_block(int block)
+{
+	if (!unshare_block(block))
+		set_free_block(block);
+}
+
 int format_timeval(struct timeval *tv, char *buf, size_t sz)
 {
 	ssize_t written = -1;
@@ -92,3 +775,53 @@ int format_timeval(struct timeval *tv, char *buf, size_t sz)
 	}
 	return written;
 }
+
+static int hist_bucket(long v)
+{
+	int e;
+
+	if(v < HIST_SUB) return v < 0 ? 0 : v;
+	if(v >= 1L << HIST_BITS) v = (1L << HIST_BITS) - 1;
+	e = 63 - __builtin_clzl(v);
+	return (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+// the largest value that falls in bucket i
+static long hist_value(int i)
+{
+	int e = i / HIST_SUB + 3;
+
+	if(i < HIST_SUB) return i;
+	return ((long)(HIST_SUB + i % HIST_SUB + 1) << (e - 4)) - 1;
+}
+
+// safe to call from several threads; one update per counter
+void hist_record(Histogram *h, long value)
+{
+	long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&h->count[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+	while(value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// the value p% of the recorded ones are at or below, to bucket precision
+long hist_percentile(Histogram *h, int p)
+{
+	long rank = (h->total * p + 99) / 100, seen = 0;
+	int i;
+
+	if(rank < 1) rank = 1;
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if(seen >= rank) return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+	return h->max;
+}
+
+void hist_reset(Histogram *h)
+{
+	memset(h, 0, sizeof(Histogram));
+}
@@ -1,9 +1,46 @@
+#ifndef FS_UTIL_H
+#define FS_UTIL_H
 
+#include <stdbool.h>
+
+int tokenize(char *line, char **argv, int max);
+int tokenize_rest(char *line, char **argv, int n);
+unsigned int name_hash(char *name);
 int rand_string(char *str, size_t size);
+
+typedef enum {FILL_RANDOM, FILL_ZERO, FILL_PATTERN} FillMode;
+
+void fill_content(char *buf, long offset, int size, FillMode mode, unsigned long seed);
 void set_bit(char *array, int index, char value);
 char get_bit(char *array, int index);
+void set_bit_atomic(char *array, int index, char value);
+char get_bit_atomic(char *array, int index);
+void alloc_init();
 int get_free_inode();
 int get_free_block();
+int get_free_blocks(int *blocks, int n);
 void set_free_inode(int i);
 void set_free_block(int i);
 int format_timeval(struct timeval *tv, char *buf, size_t sz);
+
+/*
+ * Latency histogram in the style of HdrHistogram: values below HIST_SUB
+ * are counted exactly, larger ones in HIST_SUB buckets per power of two,
+ * which keeps every recorded value within 1/HIST_SUB of its bucket.
+ * Values go up to 2^HIST_BITS.
+ */
+#define HIST_SUB 16
+#define HIST_BITS 40
+#define HIST_BUCKETS ((HIST_BITS - 3) * HIST_SUB)
+
+typedef struct {
+		long count[HIST_BUCKETS];
+		long total; // values recorded
+		long max;
+} Histogram;
+
+void hist_record(Histogram *h, long value);
+long hist_percentile(Histogram *h, int p);
+void hist_reset(Histogram *h);
+
+#endif
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs_internal.h"
+#include "fs_util.h"
+#include "journal.h"
+
+static int commit_group();
+
+static unsigned int checksum(char *data, int len) {
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)data[i];
+		h *= 16777619u;
+	} // for
+	return h;
+} // checksum()
+
+/*
+ * Copy committed groups from the log back to their home blocks, starting
+ * at the one the superblock says is the oldest not yet checkpointed and
+ * stopping at the first group that is missing, stale or torn. A block
+ * revoked by a group is not copied from the groups before it. Runs before
+ * anything else is read from the image; the superblock is reloaded since
+ * the log may hold a newer copy of it.
+ */
+int journal_replay() {
+	Journal *j = &fs->journal;
+	int start = fs->superBlock.journalStart;
+	int size = fs->superBlock.journalBlocks;
+	int pos = 0, i, g, n = 0;
+	JournalBlock desc, commit;
+	char *images;
+	int *group, *revokedIn;
+
+	j->seq = fs->superBlock.journalSeq;
+	if (start <= 0)
+		return 0;
+
+	// find the committed groups, and the last one revoking each block
+	images = (char *)malloc((JOURNAL_GROUP_BLOCKS + 1) * BLOCK_SIZE);
+	group = (int *)malloc(sizeof(int) * (size / 2 + 1));
+	revokedIn = (int *)calloc(MAX_BLOCK, sizeof(int));
+	while (pos + 2 <= size) {
+		disk_read(start + pos, (char *)&desc);
+		if (desc.magic != JOURNAL_MAGIC || desc.type != JOURNAL_DESCRIPTOR || desc.seq != j->seq + n)
+			break;
+		if (desc.count < 1 || desc.count > JOURNAL_GROUP_BLOCKS + 1 || pos + desc.count + 2 > size)
+			break;
+		disk_read_blocks(start + pos + 1, desc.count, images);
+		disk_read(start + pos + 1 + desc.count, (char *)&commit);
+		if (commit.magic != JOURNAL_MAGIC || commit.type != JOURNAL_COMMIT || commit.seq != desc.seq
+				|| commit.count != desc.count
+				|| commit.checksum != checksum(images, desc.count * BLOCK_SIZE))
+			break;
+
+		for (i = 0; i < desc.count; i++) {
+			if (desc.block[i] != JOURNAL_REVOKE)
+				continue;
+			for (g = 0; g < MAX_BLOCK; g++) {
+				if (get_bit(images + i * BLOCK_SIZE, g))
+					revokedIn[g] = n + 1;
+			} // for
+		} // for
+		group[n++] = pos;
+		pos += desc.count + 2;
+	} // while
+
+	// then copy them, groups numbered from 1 so 0 is never revoked
+	for (g = 1; g <= n; g++) {
+		disk_read(start + group[g - 1], (char *)&desc);
+		disk_read_blocks(start + group[g - 1] + 1, desc.count, images);
+		for (i = 0; i < desc.count; i++) {
+			if (desc.block[i] >= 0 && desc.block[i] < MAX_BLOCK && revokedIn[desc.block[i]] <= g)
+				disk_write(desc.block[i], images + i * BLOCK_SIZE);
+		} // for
+	} // for
+	j->seq += n;
+	free(images);
+	free(group);
+	free(revokedIn);
+
+	disk_read(0, (char *)&fs->superBlock);
+	fs->superBlock.journalStart = start;
+	fs->superBlock.journalBlocks = size;
+	fs->superBlock.journalSeq = j->seq;
+	j->stats.replayed = n;
+	if (n > 0)
+		printf("journal: replayed %d transaction group(s)\n", n);
+	return n;
+} // journal_replay()
+
+static void writeback_hook(int block) {
+	Journal *j = &fs->journal;
+
+	// nothing may reach its home block before the group changing it is logged
+	if (!j->committing && (block < 0 || get_bit(j->inGroup, block)))
+		commit_group();
+} // writeback_hook()
+
+/*
+ * Start journaling, carving the log region out of the free blocks the
+ * first time an image is mounted. Call once the bitmaps are loaded.
+ */
+int journal_init() {
+	Journal *j = &fs->journal;
+	int *blocks;
+	int i, n;
+
+	memset(j->logged, 0, sizeof(j->logged));
+	memset(j->inGroup, 0, sizeof(j->inGroup));
+	memset(j->revoke, 0, sizeof(j->revoke));
+	j->groupCount = j->groupTx = j->head = 0;
+	j->reserved = j->waiting = j->revokes = 0;
+	j->enabled = 0;
+	disk_read(0, j->superImage);
+	disk_set_writeback_hook(writeback_hook);
+
+	if (fs->superBlock.journalStart <= 0) {
+		blocks = (int *)malloc(sizeof(int) * JOURNAL_BLOCKS);
+		n = -1;
+		if (JOURNAL_BLOCKS <= free_block_count())
+			n = get_free_blocks(blocks, JOURNAL_BLOCKS);
+		// the log has to be one extent
+		if (n != 1) {
+			if (n > 1) {
+				for (i = 0; i < JOURNAL_BLOCKS; i++)
+					set_free_block(blocks[i]);
+			} // if
+			printf("journal: no room for a %d block log, metadata is not journaled\n", JOURNAL_BLOCKS);
+			free(blocks);
+			return -1;
+		} // if
+		fs->superBlock.journalStart = blocks[0];
+		fs->superBlock.journalBlocks = JOURNAL_BLOCKS;
+		fs->superBlock.journalSeq = j->seq = 1;
+		free(blocks);
+	} // if
+
+	j->enabled = 1;
+	return 0;
+} // journal_init()
+
+// where block is in the running group, groupCount if it is not
+static int group_slot(int block) {
+	Journal *j = &fs->journal;
+	int i;
+
+	if (!get_bit(j->inGroup, block))
+		return j->groupCount;
+	for (i = 0; i < j->groupCount; i++) {
+		if (j->groupBlock[i] == block)
+			break;
+	} // for
+	return i;
+} // group_slot()
+
+/*
+ * Add the new image of a metadata block to the running group. There is
+ * always room: journal_begin() reserved it for the transaction.
+ */
+static void journal_add(int block, char *buf) {
+	Journal *j = &fs->journal;
+	int i = group_slot(block);
+
+	if (i == j->groupCount) {
+		j->groupBlock[i] = block;
+		j->groupCount++;
+		set_bit_atomic(j->logged, block, 1);
+		set_bit(j->inGroup, block, 1);
+	} // if
+	memcpy(j->groupData[i + 1], buf, BLOCK_SIZE);
+} // journal_add()
+
+// store a metadata block, logging it when its contents changed
+int journal_write(int block, char *buf) {
+	Journal *j = &fs->journal;
+	int ret;
+
+	disk_lock();
+	ret = disk_write(block, buf);
+	if (ret > 0 && block == 0)
+		memcpy(j->superImage, buf, BLOCK_SIZE);
+	if (ret > 0 && j->enabled)
+		journal_add(block, buf);
+	disk_unlock();
+	return ret;
+} // journal_write()
+
+/*
+ * Store a file data block. Data is not journaled, but a block that was
+ * metadata logged since the last checkpoint has an old image that replay
+ * would write over the data: the running group revokes it, and drops its
+ * own image of the block should it have one.
+ */
+int journal_write_data(int block, char *buf) {
+	Journal *j = &fs->journal;
+	int ret, i;
+
+	// only a block that was metadata since the last checkpoint has an image in the log
+	if (!j->enabled || !get_bit_atomic(j->logged, block))
+		return disk_write(block, buf);
+
+	// one revoke covers every older image, later writes need none
+	disk_lock();
+	set_bit_atomic(j->logged, block, 0);
+	if (!get_bit(j->revoke, block)) {
+		set_bit(j->revoke, block, 1);
+		j->revokes++;
+	} // if
+	i = group_slot(block);
+	if (i < j->groupCount) {
+		j->groupCount--;
+		j->groupBlock[i] = j->groupBlock[j->groupCount];
+		memcpy(j->groupData[i + 1], j->groupData[j->groupCount + 1], BLOCK_SIZE);
+		set_bit(j->inGroup, block, 0);
+	} // if
+	ret = disk_write(block, buf);
+	disk_unlock();
+	return ret;
+} // journal_write_data()
+
+/*
+ * Start a transaction that logs at most blocks blocks, waiting until the
+ * running group has room for them. With no transaction running the group
+ * can be committed right here; otherwise the next journal_end() frees up
+ * room. Called before the transaction takes any lock.
+ */
+void journal_begin(int blocks) {
+	Journal *j = &fs->journal;
+
+	disk_lock();
+	while (j->enabled && j->groupCount + j->reserved + blocks > JOURNAL_GROUP_BLOCKS) {
+		if (j->reserved == 0) {
+			commit_group();
+			break;
+		} // if
+		if (blocks > j->waiting)
+			j->waiting = blocks;
+		disk_wait(&j->room);
+	} // while
+	j->reserved += blocks;
+	disk_unlock();
+} // journal_begin()
+
+// images the running group can take beyond what transactions reserved
+int journal_room() {
+	Journal *j = &fs->journal;
+	int room;
+
+	disk_lock();
+	room = j->enabled ? JOURNAL_GROUP_BLOCKS - j->groupCount - j->reserved : MAX_BLOCK;
+	disk_unlock();
+	return room;
+} // journal_room()
+
+/*
+ * Close a transaction begun with journal_begin(blocks), once everything
+ * it changed was written. Every transaction begun so far has made all its
+ * changes by then, see end_op(), so the group is committed here: once it
+ * is big enough, or when a waiting transaction does not fit.
+ */
+int journal_end(int blocks) {
+	Journal *j = &fs->journal;
+	int ret = 0;
+
+	disk_lock();
+	j->reserved -= blocks;
+	if (j->enabled && j->groupCount > 0)
+		j->groupTx++;
+	if (j->enabled && (j->groupTx >= JOURNAL_GROUP_TX
+			|| j->groupCount + j->reserved + j->waiting > JOURNAL_GROUP_BLOCKS))
+		ret = commit_group();
+	j->waiting = 0;
+	pthread_cond_broadcast(&j->room);
+	disk_unlock();
+	return ret;
+} // journal_end()
+
+/*
+ * Write the running group to the log: descriptor, images, the revoke map
+ * if anything was revoked, and commit block in one write, made durable
+ * with one fsync. When the log cannot take another full group afterwards,
+ * checkpoint it.
+ */
+static int commit_group() {
+	Journal *j = &fs->journal;
+	JournalBlock *desc = (JournalBlock *)j->groupData[0];
+	JournalBlock *commit;
+	int ret, i, count;
+
+	if (!j->enabled || j->committing || (j->groupCount == 0 && j->revokes == 0))
+		return 0;
+	j->committing = 1;
+
+	count = j->groupCount;
+	if (j->revokes > 0) {
+		j->groupBlock[count] = JOURNAL_REVOKE;
+		memcpy(j->groupData[count + 1], j->revoke, BLOCK_SIZE);
+		count++;
+	} // if
+
+	memset(desc, 0, BLOCK_SIZE);
+	desc->magic = JOURNAL_MAGIC;
+	desc->type = JOURNAL_DESCRIPTOR;
+	desc->seq = j->seq;
+	desc->count = count;
+	memcpy(desc->block, j->groupBlock, sizeof(int) * count);
+
+	commit = (JournalBlock *)j->groupData[count + 1];
+	memset(commit, 0, BLOCK_SIZE);
+	commit->magic = JOURNAL_MAGIC;
+	commit->type = JOURNAL_COMMIT;
+	commit->seq = j->seq;
+	commit->count = count;
+	commit->checksum = checksum(j->groupData[1], count * BLOCK_SIZE);
+
+	ret = disk_write_through(fs->superBlock.journalStart + j->head, count + 2, j->groupData[0]);
+	if (ret < 0)
+		printf("journal: commit of transaction group %d failed\n", j->seq);
+	for (i = 0; i < j->groupCount; i++)
+		set_bit(j->inGroup, j->groupBlock[i], 0);
+	memset(j->revoke, 0, sizeof(j->revoke));
+	j->head += count + 2;
+	j->seq++;
+	j->groupCount = j->groupTx = j->revokes = 0;
+	j->stats.commits++;
+	j->committing = 0;
+
+	if (j->head + JOURNAL_GROUP_BLOCKS + 3 > fs->superBlock.journalBlocks)
+		journal_checkpoint(NULL);
+	return ret;
+} // commit_group()
+
+int journal_commit() {
+	int ret;
+
+	disk_lock();
+	ret = commit_group();
+	disk_unlock();
+	return ret;
+} // journal_commit()
+
+/*
+ * Commit, write every dirty block home, then mark the log empty in the
+ * superblock. Returns what disk_sync() does. Loads no blocks, so a cache
+ * eviction can land here through the write-back hook.
+ */
+int journal_checkpoint(int *runs) {
+	Journal *j = &fs->journal;
+	int count, i;
+
+	disk_lock();
+	commit_group();
+	count = disk_sync(runs);
+	if (count < 0 || !j->enabled) {
+		disk_unlock();
+		return count;
+	} // if
+
+	// the stored superblock, the in-memory one may be ahead of the log
+	fs->superBlock.journalSeq = j->seq;
+	((SuperBlock *)j->superImage)->journalSeq = j->seq;
+	if (disk_write_through(0, 1, j->superImage) < 0) {
+		disk_unlock();
+		return -1;
+	} // if
+
+	j->head = 0;
+	// journal_write_data() reads the map without the lock
+	for (i = 0; i < sizeof(j->logged); i++)
+		__atomic_store_n(&j->logged[i], 0, __ATOMIC_RELAXED);
+	j->stats.checkpoints++;
+	disk_unlock();
+	return count;
+} // journal_checkpoint()
+
+void journal_stats(JournalStats *out) {
+	Journal *j = &fs->journal;
+
+	disk_lock();
+	*out = j->stats;
+	out->pending = j->groupTx;
+	disk_unlock();
+} // journal_stats()
@@ -0,0 +1,80 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * Metadata journal. Every command is one transaction: the metadata blocks
+ * it changes (superblock, bitmaps, inode, directory and pointer blocks)
+ * are stored through journal_write(), which also keeps a copy of each new
+ * image. Transactions are grouped, and a whole group goes to the log
+ * region as a descriptor, the block images and a commit block in a single
+ * write and a single fsync. Blocks reach their home location only after
+ * the group that last changed them is in the log: disk_write() keeps them
+ * off the image until disk_sync(), which commits first (in DISK_MMAP mode
+ * they wait in a shadow copy, out of the shared mapping). fs_mount()
+ * replays whatever groups were committed but not yet checkpointed. The
+ * journal state is guarded by the disk lock, see disk_lock().
+ *
+ * A transaction is never split: it reserves room in the running group
+ * with journal_begin() for every block it may log, waiting while the group
+ * is too full for it, and groups are committed only between transactions.
+ * File data is not logged; data written to a block that still has an old
+ * image in the log revokes that image instead, so replay skips it.
+ */
+#define JOURNAL_MAGIC 0x4A524E4C // "JRNL"
+#define JOURNAL_BLOCKS 256 // size of the log region
+#define JOURNAL_GROUP_TX 8 // transactions batched into one commit
+#define JOURNAL_GROUP_BLOCKS 120 // block images one commit can carry, the revoke map aside
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+#define JOURNAL_REVOKE -1 // home of the image holding a group's revoke map
+
+typedef struct {
+		int magic;
+		int type; // JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+		int seq;
+		int count; // block images in the group
+		unsigned int checksum; // commit block only, over the images
+		int block[(BLOCK_SIZE - 5 * sizeof(int)) / sizeof(int)]; // descriptor only: home of each image
+} JournalBlock;
+
+typedef struct {
+		int commits;
+		int checkpoints;
+		int replayed; // groups replayed at mount
+		int pending; // transactions waiting for the next commit
+} JournalStats;
+
+// journal state of one mounted image
+typedef struct {
+		// the group being built: its home blocks and their newest images
+		int groupBlock[JOURNAL_GROUP_BLOCKS + 1];
+		char groupData[JOURNAL_GROUP_BLOCKS + 3][BLOCK_SIZE]; // descriptor, images, revoke map, commit
+		int groupCount, groupTx;
+		int reserved; // blocks the running transactions may still log
+		int waiting; // the most a transaction waiting in journal_begin() asks for
+		pthread_cond_t room; // signaled when reserved room is given back
+		char revoke[MAX_BLOCK / 8]; // blocks whose older images replay skips
+		int revokes;
+
+		int enabled; // 0 until the log region exists, and while replaying
+		int head; // next free block of the log region
+		int seq; // sequence number of the next group
+		char logged[MAX_BLOCK / 8]; // blocks with an image in the log since the last checkpoint
+		char inGroup[MAX_BLOCK / 8]; // blocks in the running group
+		char superImage[BLOCK_SIZE]; // block 0 as the disk layer holds it
+		int committing;
+		JournalStats stats;
+} Journal;
+
+int journal_replay();
+int journal_init();
+int journal_write(int block, char *buf);
+int journal_write_data(int block, char *buf);
+void journal_begin(int blocks);
+int journal_room();
+int journal_end(int blocks);
+int journal_commit();
+int journal_checkpoint(int *runs);
+void journal_stats(JournalStats *out);
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <time.h>
+#include "trace.h"
+
+struct Trace {
+	FILE *f;
+	long origin; // trace_clock() when the trace began, for writing
+	char *buf; // the tokens of the last record read
+	size_t cap;
+};
+
+// monotonic nanoseconds, the time base of every record
+long trace_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int put(Trace *t, void *p, size_t n)
+{
+	return fwrite(p, 1, n, t->f) == n ? 0 : -1;
+}
+
+static int put32(Trace *t, uint32_t v)
+{
+	v = htole32(v);
+	return put(t, &v, 4);
+}
+
+static int put64(Trace *t, uint64_t v)
+{
+	v = htole64(v);
+	return put(t, &v, 8);
+}
+
+static int get(Trace *t, void *p, size_t n)
+{
+	return fread(p, 1, n, t->f) == n ? 0 : -1;
+}
+
+static int get32(Trace *t, uint32_t *v)
+{
+	if(get(t, v, 4) < 0) return -1;
+	*v = le32toh(*v);
+	return 0;
+}
+
+static int get64(Trace *t, uint64_t *v)
+{
+	if(get(t, v, 8) < 0) return -1;
+	*v = le64toh(*v);
+	return 0;
+}
+
+static Trace *trace_new(char *name, char *how)
+{
+	Trace *t = calloc(1, sizeof(Trace));
+
+	if(t == NULL) return NULL;
+	if((t->f = fopen(name, how)) == NULL) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+// start a trace in name, replacing what was there; NULL on failure
+Trace *trace_create(char *name)
+{
+	Trace *t = trace_new(name, "wb");
+
+	if(t == NULL) return NULL;
+	if(put32(t, TRACE_MAGIC) < 0 || put32(t, TRACE_VERSION) < 0) {
+		trace_close(t);
+		return NULL;
+	}
+	t->origin = trace_clock();
+	return t;
+}
+
+/*
+ * Append a command that began at start (a trace_clock() value) and took
+ * duration ns. Tokens past TRACE_MAX_ARGS are dropped, as are bytes of a
+ * token past 65535. Returns -1 when the write failed.
+ */
+int trace_write(Trace *t, long start, long duration, int argc, char **argv)
+{
+	unsigned char n = argc > TRACE_MAX_ARGS ? TRACE_MAX_ARGS : argc;
+	int i;
+
+	if(put64(t, start - t->origin) < 0 || put64(t, duration) < 0 || put(t, &n, 1) < 0) return -1;
+	for(i = 0; i < n; i++) {
+		size_t len = strlen(argv[i]);
+		uint16_t l16;
+		if(len > UINT16_MAX) len = UINT16_MAX;
+		l16 = htole16(len);
+		if(put(t, &l16, 2) < 0 || put(t, argv[i], len) < 0) return -1;
+	}
+	return 0;
+}
+
+// open a trace for reading; NULL when it cannot be opened or is not a trace
+Trace *trace_open(char *name)
+{
+	Trace *t = trace_new(name, "rb");
+	uint32_t magic, version;
+
+	if(t == NULL) return NULL;
+	if(get32(t, &magic) < 0 || get32(t, &version) < 0 || magic != TRACE_MAGIC || version != TRACE_VERSION) {
+		trace_close(t);
+		return NULL;
+	}
+	return t;
+}
+
+/*
+ * Read the next record into r. Its tokens stay valid until the next
+ * call. Returns 1, 0 at the end of the trace or -1 on a damaged record.
+ */
+int trace_read(Trace *t, TraceRecord *r)
+{
+	uint64_t start, duration;
+	unsigned char n;
+	size_t at[TRACE_MAX_ARGS], off = 0;
+	uint16_t len;
+	int i;
+
+	if(get64(t, &start) < 0) return feof(t->f) ? 0 : -1;
+	if(get64(t, &duration) < 0 || get(t, &n, 1) < 0) return -1;
+	for(i = 0; i < n; i++) {
+		if(get(t, &len, 2) < 0) return -1;
+		len = le16toh(len);
+		if(off + len + 1 > t->cap) {
+			size_t cap = (off + len + 1) * 2;
+			char *p = realloc(t->buf, cap);
+			if(p == NULL) return -1;
+			t->buf = p;
+			t->cap = cap;
+		}
+		if(get(t, t->buf + off, len) < 0) return -1;
+		t->buf[off + len] = '\0';
+		at[i] = off;
+		off += len + 1;
+	}
+	// the buffer may have moved while growing
+	for(i = 0; i < n; i++)
+		r->argv[i] = t->buf + at[i];
+	r->start = start;
+	r->duration = duration;
+	r->argc = n;
+	return 1;
+}
+
+int trace_close(Trace *t)
+{
+	int ret = fclose(t->f);
+	free(t->buf);
+	free(t);
+	return ret == 0 ? 0 : -1;
+}
@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+/*
+ * Command trace: what fs_sim -t records and fs_replay plays back. The file
+ * is a header (magic, version) followed by one record per command:
+ *   start     8 bytes, ns since the trace began
+ *   duration  8 bytes, ns the command took when it was traced
+ *   argc      1 byte
+ *   argv      argc times a 2-byte length and the token, no terminator
+ * All numbers are little-endian.
+ */
+#define TRACE_MAGIC 0x52545346 // "FSTR"
+#define TRACE_VERSION 1
+#define TRACE_MAX_ARGS 255
+
+typedef struct Trace Trace;
+
+typedef struct {
+		long start;
+		long duration;
+		int argc;
+		char *argv[TRACE_MAX_ARGS];
+} TraceRecord;
+
+long trace_clock();
+Trace *trace_create(char *name);
+int trace_write(Trace *t, long start, long duration, int argc, char **argv);
+Trace *trace_open(char *name);
+int trace_read(Trace *t, TraceRecord *r);
+int trace_close(Trace *t);
+
+#endif